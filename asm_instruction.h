@@ -0,0 +1,120 @@
+#pragma once
+#include <stdint.h>
+
+// X86 is 32 bit cdecl code. X86_64 is 64 bit System V code: the stack and frame pointers and
+// every push are 64 bit, values stay 32 bit.
+enum struct AsmTarget : uint8_t
+{
+    X86,
+    X86_64
+};
+
+// In the order of their x86 encodings, R8 to R15 only exist on X86_64.
+enum struct AsmRegister : uint8_t
+{
+    Eax,
+    Ecx,
+    Edx,
+    Ebx,
+    Esp,
+    Ebp,
+    Esi,
+    Edi,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15
+};
+
+// Memory operands are always dwords at a register plus a displacement.
+struct AsmOperand
+{
+    enum struct Type : uint8_t
+    {
+        None,
+        Register,
+        Immediate,
+        Memory
+    };
+
+    Type type;
+    AsmRegister reg; // The register, or the base of a memory operand.
+    int32_t value; // The immediate, or the displacement of a memory operand.
+};
+
+// Instructions in Intel operand order, dst is the one that's written. Label marks the start of a
+// function and uses symbol for its name.
+struct AsmInstruction
+{
+    enum struct Op : uint8_t
+    {
+        Label,
+        Push,
+        Pop,
+        Mov,
+        Add,
+        Sub,
+        Imul,
+        Neg,
+        Cdq,
+        Idiv,
+        Lea,
+        Ret
+    };
+
+    Op op;
+    AsmOperand dst;
+    AsmOperand src;
+    uint32_t symbol;
+};
+
+inline AsmOperand asm_reg(AsmRegister reg)
+{
+    AsmOperand o = {};
+    o.type = AsmOperand::Type::Register;
+    o.reg = reg;
+    return o;
+}
+
+inline AsmOperand asm_imm(int32_t value)
+{
+    AsmOperand o = {};
+    o.type = AsmOperand::Type::Immediate;
+    o.value = value;
+    return o;
+}
+
+inline AsmOperand asm_mem(AsmRegister base, int32_t displacement)
+{
+    AsmOperand o = {};
+    o.type = AsmOperand::Type::Memory;
+    o.reg = base;
+    o.value = displacement;
+    return o;
+}
+
+inline bool asm_operand_equal(const AsmOperand& a, const AsmOperand& b)
+{
+    if (a.type != b.type)
+        return false;
+
+    switch (a.type)
+    {
+        case AsmOperand::Type::None: return true;
+        case AsmOperand::Type::Register: return a.reg == b.reg;
+        case AsmOperand::Type::Immediate: return a.value == b.value;
+        case AsmOperand::Type::Memory: return a.reg == b.reg && a.value == b.value;
+    }
+
+    return false;
+}
+
+// True if reading or writing o involves reg, as the register itself or as the base of memory.
+inline bool asm_operand_uses_register(const AsmOperand& o, AsmRegister reg)
+{
+    return (o.type == AsmOperand::Type::Register || o.type == AsmOperand::Type::Memory) && o.reg == reg;
+}
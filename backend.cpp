@@ -0,0 +1,404 @@
+#include "backend.h"
+#include "file.h"
+#include "generator.h"
+#include "memory.h"
+#include "parser.h"
+#include "threading.h"
+#include "encoder.h"
+#include <atomic>
+
+// Every node of the root scope, which in practice is every top level function, is generated and
+// translated on its own, since functions share nothing but the output. Each worker starts out
+// owning an equal share of the nodes and takes them from the front of its share. A worker that
+// runs out steals the back half of the share of another worker, so uneven function sizes don't
+// leave threads idle. Output goes to a buffer per worker, and the pieces are concatenated in node
+// order at the end, which makes the output independent of scheduling.
+static const unsigned ParallelBackendMinNodes = 256;
+static const unsigned MaxBackendThreads = 16;
+
+// Each worker's temp memory is carved out of the temp memory of the thread that starts it.
+static const size_t BackendWorkerTempMemorySize = 32 * 1024 * 1024;
+
+struct BackendPiece
+{
+    uint32_t worker;
+    size_t asm_offset;
+    size_t asm_len;
+    uint32_t code_offset;
+    uint32_t code_len;
+    uint32_t symbols_first;
+    uint32_t symbols_end;
+    uint32_t relocations_first;
+    uint32_t relocations_end;
+};
+
+struct BackendShared
+{
+    const Ast* ast;
+    const SymbolTable* symbols;
+    CompileOptions options;
+    BackendPiece* pieces;
+    struct BackendWorker* workers;
+    unsigned num_workers;
+};
+
+// range packs the worker's remaining share of nodes, the first in the low 32 bits and the end in
+// the high 32 bits, so that the owner and thieves can both shrink it with a compare and swap.
+struct BackendWorker
+{
+    std::atomic<uint64_t> range;
+    BackendShared* shared;
+    unsigned index;
+    Allocator heap;
+    void* temp_memory;
+    CompileStats stats;
+    AsmTranslationResult asm_text;
+    MachineCode machine_code;
+    Thread thread;
+};
+
+static uint64_t pack_range(uint32_t first, uint32_t end)
+{
+    return (uint64_t)end << 32 | first;
+}
+
+static bool take_own_node(BackendWorker* w, uint32_t* node)
+{
+    uint64_t r = w->range.load(std::memory_order_acquire);
+
+    while (true)
+    {
+        const uint32_t first = (uint32_t)r;
+        const uint32_t end = (uint32_t)(r >> 32);
+
+        if (first >= end)
+            return false;
+
+        if (w->range.compare_exchange_weak(r, pack_range(first + 1, end), std::memory_order_acq_rel))
+        {
+            *node = first;
+            return true;
+        }
+    }
+}
+
+// Moves the back half of victim's share to thief, returns false if victim had nothing left.
+static bool steal_nodes(BackendWorker* thief, BackendWorker* victim)
+{
+    uint64_t r = victim->range.load(std::memory_order_acquire);
+
+    while (true)
+    {
+        const uint32_t first = (uint32_t)r;
+        const uint32_t end = (uint32_t)(r >> 32);
+
+        if (first >= end)
+            return false;
+
+        const uint32_t mid = first + (end - first) / 2;
+
+        if (victim->range.compare_exchange_weak(r, pack_range(first, mid), std::memory_order_acq_rel))
+        {
+            thief->range.store(pack_range(mid, end), std::memory_order_release);
+            return true;
+        }
+    }
+}
+
+static bool steal_any_nodes(BackendWorker* w)
+{
+    const BackendShared& shared = *w->shared;
+
+    for (unsigned i = 1; i < shared.num_workers; ++i)
+    {
+        if (steal_nodes(w, shared.workers + (w->index + i) % shared.num_workers))
+            return true;
+    }
+
+    return false;
+}
+
+void compile_stats_add(CompileStats* to, const CompileStats& from)
+{
+    optimizer_stats_add(&to->optimizer, from.optimizer);
+    peephole_stats_add(&to->peephole, from.peephole);
+}
+
+static TranslationOutput translation_output(const CompileOptions& options, AsmTranslationResult* asm_text, Allocator* asm_text_allocator, MachineCode* machine_code)
+{
+    TranslationOutput out = {};
+
+    if (options.emit_asm)
+    {
+        out.asm_text = asm_text;
+        out.asm_text_allocator = asm_text_allocator;
+    }
+
+    if (options.emit_machine_code)
+        out.machine_code = machine_code;
+
+    out.target = options.target;
+    out.no_red_zone = options.no_red_zone;
+    return out;
+}
+
+// The generator allocates registers for the target that the code is translated for.
+static GeneratorOptions generator_options(const CompileOptions& options)
+{
+    GeneratorOptions go = options.generator;
+    go.target = options.target;
+    return go;
+}
+
+static void optimize_generated_code(GeneratedCode* gc, const CompileOptions& options, CompileStats* stats)
+{
+    if (optimizer_options_any(options.optimizer))
+        optimize(gc, options.optimizer, generator_options(options), &stats->optimizer);
+}
+
+static void backend_worker(void* arg)
+{
+    BackendWorker* w = (BackendWorker*)arg;
+    const BackendShared& shared = *w->shared;
+    const Ast& ast = *shared.ast;
+    temp_memory_blob_init(w->temp_memory, BackendWorkerTempMemorySize);
+    GeneratedCode gc;
+    generated_code_init(&gc, &w->heap);
+
+    while (true)
+    {
+        uint32_t node;
+
+        if (!take_own_node(w, &node))
+        {
+            // Nothing is ever added to a share, so once a pass over every other worker found
+            // nothing all nodes have been taken.
+            if (!steal_any_nodes(w))
+                break;
+
+            continue;
+        }
+
+        ParseScope nodes = {};
+        nodes.first = ast.root.first + node;
+        nodes.num = 1;
+        generated_code_clear(&gc);
+        generate_nodes(&gc, ast, nodes, generator_options(shared.options));
+        optimize_generated_code(&gc, shared.options, &w->stats);
+
+        BackendPiece& piece = shared.pieces[node];
+        piece.worker = w->index;
+        piece.asm_offset = w->asm_text.len;
+        piece.code_offset = w->machine_code.code.num;
+        piece.symbols_first = w->machine_code.symbols.num;
+        piece.relocations_first = w->machine_code.relocations.num;
+        translate_chunks(translation_output(shared.options, &w->asm_text, &w->heap, &w->machine_code), gc, *shared.symbols, shared.options.peephole, &w->stats.peephole);
+        piece.asm_len = w->asm_text.len - piece.asm_offset;
+        piece.code_len = w->machine_code.code.num - piece.code_offset;
+        piece.symbols_end = w->machine_code.symbols.num;
+        piece.relocations_end = w->machine_code.relocations.num;
+    }
+
+    generated_code_destroy(&gc);
+}
+
+static unsigned num_backend_threads(unsigned num_nodes)
+{
+    unsigned n = thread_num_cpus();
+
+    if (n > MaxBackendThreads)
+        n = MaxBackendThreads;
+
+    if (n > num_nodes / ParallelBackendMinNodes)
+        n = num_nodes / ParallelBackendMinNodes;
+
+    return n < 1 ? 1 : n;
+}
+
+static CompileResult compile_serial(Allocator* allocator, const Ast& ast, const SymbolTable& symbols, const CompileOptions& options, CompileStats* stats)
+{
+    CompileResult r = {};
+    machine_code_init(&r.machine_code, allocator);
+    GeneratedCode gc = generate(allocator, ast, generator_options(options));
+    optimize_generated_code(&gc, options, stats);
+
+    if (options.emit_asm)
+        translate_section_header(&r.asm_text, allocator);
+
+    translate_chunks(translation_output(options, &r.asm_text, allocator, &r.machine_code), gc, symbols, options.peephole, &stats->peephole);
+    generated_code_destroy(&gc);
+    return r;
+}
+
+// Appends the machine code of a piece, moving its symbols and relocations along with it.
+static void append_machine_code_piece(MachineCode* to, const MachineCode& from, const BackendPiece& piece)
+{
+    const uint32_t base = to->code.num;
+
+    for (uint32_t i = piece.code_offset; i < piece.code_offset + piece.code_len; ++i)
+        to->code.add(from.code[i]);
+
+    for (uint32_t i = piece.symbols_first; i < piece.symbols_end; ++i)
+    {
+        MachineCodeSymbol s = from.symbols[i];
+        s.offset = s.offset - piece.code_offset + base;
+        to->symbols.add(s);
+    }
+
+    for (uint32_t i = piece.relocations_first; i < piece.relocations_end; ++i)
+    {
+        MachineCodeRelocation r = from.relocations[i];
+        r.offset = r.offset - piece.code_offset + base;
+        to->relocations.add(r);
+    }
+}
+
+#if defined(DEBUG)
+static bool machine_code_equal(const MachineCode& a, const MachineCode& b)
+{
+    return a.code.num == b.code.num && a.symbols.num == b.symbols.num && a.relocations.num == b.relocations.num
+        && memcmp(a.code.data, b.code.data, a.code.num) == 0
+        && memcmp(a.symbols.data, b.symbols.data, a.symbols.num * sizeof(MachineCodeSymbol)) == 0
+        && memcmp(a.relocations.data, b.relocations.data, a.relocations.num * sizeof(MachineCodeRelocation)) == 0;
+}
+#endif
+
+CompileResult compile(Allocator* allocator, const Ast& ast, const SymbolTable& symbols, const CompileOptions& options, CompileStats* stats)
+{
+    const unsigned num_threads = num_backend_threads(ast.root.num);
+
+    if (num_threads < 2)
+        return compile_serial(allocator, ast, symbols, options, stats);
+
+    Allocator ta = create_temp_allocator();
+    BackendShared shared = {};
+    shared.ast = &ast;
+    shared.symbols = &symbols;
+    shared.options = options;
+    shared.pieces = (BackendPiece*)ta.alloc(sizeof(BackendPiece) * ast.root.num);
+    BackendWorker workers[MaxBackendThreads] = {};
+    shared.workers = workers;
+    shared.num_workers = num_threads;
+
+    for (unsigned i = 0; i < num_threads; ++i)
+    {
+        BackendWorker& w = workers[i];
+        const uint32_t first = (uint32_t)((uint64_t)ast.root.num * i / num_threads);
+        const uint32_t end = (uint32_t)((uint64_t)ast.root.num * (i + 1) / num_threads);
+        w.range.store(pack_range(first, end));
+        w.shared = &shared;
+        w.index = i;
+        w.heap = create_heap_allocator();
+        w.temp_memory = ta.alloc(BackendWorkerTempMemorySize);
+        w.asm_text = {};
+        machine_code_init(&w.machine_code, &w.heap);
+    }
+
+    for (unsigned i = 0; i < num_threads; ++i)
+        thread_start(&workers[i].thread, backend_worker, workers + i);
+
+    for (unsigned i = 0; i < num_threads; ++i)
+    {
+        thread_join(&workers[i].thread);
+        compile_stats_add(stats, workers[i].stats);
+    }
+
+    CompileResult r = {};
+    machine_code_init(&r.machine_code, allocator);
+
+    if (options.emit_asm)
+    {
+        translate_section_header(&r.asm_text, allocator);
+        size_t len = r.asm_text.len;
+
+        for (unsigned i = 0; i < num_threads; ++i)
+            len += workers[i].asm_text.len;
+
+        char* data = (char*)allocator->alloc(len);
+        memcpy(data, r.asm_text.data, r.asm_text.len);
+        allocator->dealloc(r.asm_text.data);
+        r.asm_text.data = data;
+        r.asm_text.capacity = len;
+    }
+
+    for (unsigned i = 0; i < ast.root.num; ++i)
+    {
+        const BackendPiece& piece = shared.pieces[i];
+        const BackendWorker& w = workers[piece.worker];
+
+        if (options.emit_asm)
+        {
+            memcpy(r.asm_text.data + r.asm_text.len, w.asm_text.data + piece.asm_offset, piece.asm_len);
+            r.asm_text.len += piece.asm_len;
+        }
+
+        if (options.emit_machine_code)
+            append_machine_code_piece(&r.machine_code, w.machine_code, piece);
+    }
+
+    for (unsigned i = 0; i < num_threads; ++i)
+    {
+        workers[i].heap.dealloc(workers[i].asm_text.data);
+        machine_code_destroy(&workers[i].machine_code);
+    }
+
+    #if defined(DEBUG)
+        CompileStats serial_stats = {};
+        CompileResult serial = compile_serial(&ta, ast, symbols, options, &serial_stats);
+        Assert(serial.asm_text.len == r.asm_text.len && memcmp(serial.asm_text.data, r.asm_text.data, r.asm_text.len) == 0
+            && machine_code_equal(serial.machine_code, r.machine_code),
+            "Error in backend: Parallel and serial compilation generated different result.");
+    #endif
+
+    return r;
+}
+
+void compile_result_destroy(Allocator* allocator, CompileResult* result)
+{
+    allocator->dealloc(result->asm_text.data);
+    machine_code_destroy(&result->machine_code);
+}
+
+bool compile_stream(Allocator* allocator, TokenRing* ring, const SymbolTable& symbols, const CompileOptions& options, CompileStats* stats, const char* asm_filename, MachineCode* machine_code)
+{
+    FileWriter fw = {};
+
+    if (options.emit_asm)
+    {
+        fw = file_writer_open(asm_filename);
+
+        if (!fw.valid)
+            return false;
+
+        Allocator ta = create_temp_allocator();
+        AsmTranslationResult header = {};
+        translate_section_header(&header, &ta);
+        file_writer_append(&fw, header.data, header.len);
+    }
+
+    StreamingParser* sp = streaming_parser_create(allocator, ring);
+    bool ok = true;
+
+    while (ok)
+    {
+        // Everything a piece needs lives in temp memory that is rewound once the piece is
+        // written, so peak memory is set by the largest function instead of by the whole file.
+        Allocator ta = create_temp_allocator();
+        Ast ast;
+
+        if (!streaming_parser_next(sp, &ta, &ast))
+            break;
+
+        GeneratedCode gc = generate(&ta, ast, generator_options(options));
+        optimize_generated_code(&gc, options, stats);
+        AsmTranslationResult tr = {};
+        translate_chunks(translation_output(options, &tr, &ta, machine_code), gc, symbols, options.peephole, &stats->peephole);
+
+        if (options.emit_asm)
+            ok = file_writer_append(&fw, tr.data, tr.len);
+    }
+
+    streaming_parser_destroy(allocator, sp);
+    file_writer_close(&fw);
+    return ok;
+}
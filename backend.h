@@ -0,0 +1,52 @@
+#pragma once
+#include "translator.h"
+#include "generator.h"
+#include "optimizer.h"
+#include "peephole.h"
+#include "encoder.h"
+#include "asm_instruction.h"
+
+struct Allocator;
+struct Ast;
+struct SymbolTable;
+struct TokenRing;
+
+struct CompileOptions
+{
+    GeneratorOptions generator;
+    OptimizerOptions optimizer;
+    PeepholeOptions peephole;
+    bool emit_asm;
+    bool emit_machine_code;
+    AsmTarget target;
+    bool no_red_zone;
+};
+
+// Only the outputs that the options ask for are filled in.
+struct CompileResult
+{
+    AsmTranslationResult asm_text;
+    MachineCode machine_code;
+};
+
+struct CompileStats
+{
+    OptimizerStats optimizer;
+    PeepholeStats peephole;
+};
+
+void compile_stats_add(CompileStats* to, const CompileStats& from);
+
+// Generates, optimizes and translates the whole AST to asm text and machine code. Large ASTs are
+// split up by top level function and compiled on several threads, the output is the same as a
+// serial generate, optimize and translate. What the optimizer and the peephole rules did is added
+// to stats.
+CompileResult compile(Allocator* allocator, const Ast& ast, const SymbolTable& symbols, const CompileOptions& options, CompileStats* stats);
+void compile_result_destroy(Allocator* allocator, CompileResult* result);
+
+// Parses, generates and translates one top level function at a time from a ring with an inline
+// producer. The asm of each function is appended to asm_filename before the next one is read,
+// the machine code is collected in machine_code. Only the function that is being compiled, the
+// symbols and the machine code are kept in memory. The output is the same as compile of the
+// whole file. Returns false if writing asm_filename failed.
+bool compile_stream(Allocator* allocator, TokenRing* ring, const SymbolTable& symbols, const CompileOptions& options, CompileStats* stats, const char* asm_filename, MachineCode* machine_code);
@@ -35,6 +35,7 @@ end
 local set_env = arg_contain("set_env")
 local build = arg_contain("build")
 local run = arg_contain("run")
+local test = arg_contain("test")
 local use_debug = arg_contain("use_debug")
 
 function run_or_die(cmd)
@@ -84,3 +85,8 @@ end
 if run then
     run_or_die("skugga.exe")
 end
+
+-- start in test.kra returns 0, anything else or a crash fails.
+if test then
+    run_or_die("krang.exe --run test.kra")
+end
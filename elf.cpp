@@ -0,0 +1,686 @@
+#include "elf.h"
+#include "encoder.h"
+#include "file.h"
+#include "memory.h"
+#include "symbol_table.h"
+#include "asm_instruction.h"
+#include <stdio.h>
+
+static const unsigned ElfHeaderSize = 52;
+static const unsigned ElfProgramHeaderSize = 32;
+static const unsigned ElfSectionHeaderSize = 40;
+static const unsigned ElfSymbolSize = 16;
+static const unsigned ElfRelSize = 8;
+
+static const unsigned Elf64HeaderSize = 64;
+static const unsigned Elf64SectionHeaderSize = 64;
+static const unsigned Elf64SymbolSize = 24;
+static const unsigned Elf64RelaSize = 24;
+
+static const uint16_t ElfTypeRelocatable = 1;
+static const uint16_t ElfTypeExecutable = 2;
+static const uint16_t ElfMachine386 = 3;
+static const uint16_t ElfMachineX86_64 = 62;
+
+static const uint32_t SectionTypeProgbits = 1;
+static const uint32_t SectionTypeSymtab = 2;
+static const uint32_t SectionTypeStrtab = 3;
+static const uint32_t SectionTypeRela = 4;
+static const uint32_t SectionTypeRel = 9;
+static const uint32_t SectionFlagAlloc = 0x2;
+static const uint32_t SectionFlagExecInstr = 0x4;
+
+static const uint8_t SymbolBindLocal = 0;
+static const uint8_t SymbolBindGlobal = 1;
+static const uint8_t SymbolTypeNone = 0;
+static const uint8_t SymbolTypeFunc = 2;
+static const uint8_t SymbolTypeSection = 3;
+
+// The same number for R_386_PC32 and R_X86_64_PC32.
+static const uint32_t RelocationPc32 = 2;
+
+enum struct ElfSection : uint16_t
+{
+    Null,
+    Text,
+    Symtab,
+    Strtab,
+    RelText,
+    Shstrtab,
+    Num
+};
+
+static const char* section_names[] = {"", ".text", ".symtab", ".strtab", ".rel.text", ".shstrtab"};
+static_assert(sizeof(section_names) / sizeof(section_names[0]) == (size_t)ElfSection::Num, "Missing section name.");
+
+// 32 bit ELF files for X86 and 64 bit ones for X86_64. The 64 bit ones have 64 bit addresses,
+// offsets and sizes, and relocations with an explicit addend in .rela.text.
+struct ElfFormat
+{
+    bool is_64_bit;
+    uint16_t machine;
+    unsigned header_size;
+    unsigned section_header_size;
+    unsigned symbol_size;
+    unsigned relocation_size;
+    uint32_t relocation_section_type;
+    const char* relocation_section_name;
+};
+
+static const ElfFormat elf_format_32 = {false, ElfMachine386, ElfHeaderSize, ElfSectionHeaderSize, ElfSymbolSize, ElfRelSize, SectionTypeRel, ".rel.text"};
+static const ElfFormat elf_format_64 = {true, ElfMachineX86_64, Elf64HeaderSize, Elf64SectionHeaderSize, Elf64SymbolSize, Elf64RelaSize, SectionTypeRela, ".rela.text"};
+
+static void put_u8(DynamicArray<uint8_t>* b, uint8_t v)
+{
+    b->add(v);
+}
+
+static void put_u16(DynamicArray<uint8_t>* b, uint16_t v)
+{
+    put_u8(b, (uint8_t)v);
+    put_u8(b, (uint8_t)(v >> 8));
+}
+
+static void put_u32(DynamicArray<uint8_t>* b, uint32_t v)
+{
+    put_u16(b, (uint16_t)v);
+    put_u16(b, (uint16_t)(v >> 16));
+}
+
+static void put_u64(DynamicArray<uint8_t>* b, uint64_t v)
+{
+    put_u32(b, (uint32_t)v);
+    put_u32(b, (uint32_t)(v >> 32));
+}
+
+// An address, offset or size, which are as wide as the format.
+static void put_word(DynamicArray<uint8_t>* b, const ElfFormat& format, uint32_t v)
+{
+    if (format.is_64_bit)
+        put_u64(b, v);
+    else
+        put_u32(b, v);
+}
+
+static void put_bytes(DynamicArray<uint8_t>* b, const void* data, size_t size)
+{
+    while (b->data == nullptr || b->capacity - b->num < size)
+        b->grow();
+
+    memcpy(b->data + b->num, data, size);
+    b->num += (unsigned)size;
+}
+
+static void put_align(DynamicArray<uint8_t>* b, unsigned align)
+{
+    while (b->num % align != 0)
+        put_u8(b, 0);
+}
+
+static void put_u32_at(DynamicArray<uint8_t>* b, uint32_t offset, uint32_t v)
+{
+    for (unsigned i = 0; i < 4; ++i)
+        (*b)[offset + i] = (uint8_t)(v >> (i * 8));
+}
+
+// Adds a '\0' terminated string to a string table and returns its offset in it.
+static uint32_t add_string(DynamicArray<uint8_t>* strtab, const char* str, unsigned len)
+{
+    const uint32_t offset = strtab->num;
+    put_bytes(strtab, str, len);
+    put_u8(strtab, 0);
+    return offset;
+}
+
+static void put_symbol(DynamicArray<uint8_t>* b, const ElfFormat& format, uint32_t name, uint32_t value, uint32_t size, uint8_t bind, uint8_t type, uint16_t section)
+{
+    put_u32(b, name);
+
+    if (!format.is_64_bit)
+    {
+        put_u32(b, value);
+        put_u32(b, size);
+    }
+
+    put_u8(b, (uint8_t)(bind << 4 | type));
+    put_u8(b, 0);
+    put_u16(b, section);
+
+    if (format.is_64_bit)
+    {
+        put_u64(b, value);
+        put_u64(b, size);
+    }
+}
+
+struct ElfSectionHeader
+{
+    uint32_t name;
+    uint32_t type;
+    uint32_t flags;
+    uint32_t address;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t link;
+    uint32_t info;
+    uint32_t align;
+    uint32_t entry_size;
+};
+
+// Fills in the header that b was started with room for.
+static void put_elf_header(DynamicArray<uint8_t>* b, const ElfFormat& format, uint16_t type, uint32_t entry, uint16_t num_program_headers, uint32_t section_headers_offset, uint16_t num_sections, uint16_t shstrtab_section)
+{
+    Allocator ta = create_temp_allocator();
+    DynamicArray<uint8_t> header = dynamic_array_create<uint8_t>(&ta);
+    const uint8_t ident[16] = {0x7f, 'E', 'L', 'F', (uint8_t)(format.is_64_bit ? 2 : 1), 1, 1};
+    put_bytes(&header, ident, sizeof(ident));
+    put_u16(&header, type);
+    put_u16(&header, format.machine);
+    put_u32(&header, 1);
+    put_word(&header, format, entry);
+    put_word(&header, format, num_program_headers > 0 ? format.header_size : 0);
+    put_word(&header, format, section_headers_offset);
+    put_u32(&header, 0);
+    put_u16(&header, (uint16_t)format.header_size);
+    put_u16(&header, num_program_headers > 0 ? ElfProgramHeaderSize : 0);
+    put_u16(&header, num_program_headers);
+    put_u16(&header, (uint16_t)format.section_header_size);
+    put_u16(&header, num_sections);
+    put_u16(&header, shstrtab_section);
+    Assert(header.num == format.header_size, "Error in ELF writer: Wrong header size.");
+    memcpy(b->data, header.data, header.num);
+}
+
+// Appends the section headers and returns where they start.
+static uint32_t put_section_headers(DynamicArray<uint8_t>* b, const ElfFormat& format, const ElfSectionHeader* sections, unsigned num)
+{
+    put_align(b, format.is_64_bit ? 8 : 4);
+    const uint32_t offset = b->num;
+
+    for (unsigned i = 0; i < num; ++i)
+    {
+        const ElfSectionHeader& sh = sections[i];
+        put_u32(b, sh.name);
+        put_u32(b, sh.type);
+        put_word(b, format, sh.flags);
+        put_word(b, format, sh.address);
+        put_word(b, format, sh.offset);
+        put_word(b, format, sh.size);
+        put_u32(b, sh.link);
+        put_u32(b, sh.info);
+        put_word(b, format, sh.align);
+        put_word(b, format, sh.entry_size);
+    }
+
+    return offset;
+}
+
+// Appends a symbol table, its string table and the section name string table, and fills in
+// their headers.
+static void put_symbol_tables(DynamicArray<uint8_t>* b, const ElfFormat& format, ElfSectionHeader* sections, const DynamicArray<uint8_t>& symtab, const DynamicArray<uint8_t>& strtab, uint32_t first_global_symbol, const DynamicArray<uint8_t>& shstrtab)
+{
+    const unsigned align = format.is_64_bit ? 8 : 4;
+    put_align(b, align);
+    ElfSectionHeader& sym = sections[(unsigned)ElfSection::Symtab];
+    sym.type = SectionTypeSymtab;
+    sym.offset = b->num;
+    sym.size = symtab.num;
+    sym.link = (uint32_t)ElfSection::Strtab;
+    sym.info = first_global_symbol;
+    sym.align = align;
+    sym.entry_size = format.symbol_size;
+    put_bytes(b, symtab.data, symtab.num);
+
+    ElfSectionHeader& str = sections[(unsigned)ElfSection::Strtab];
+    str.type = SectionTypeStrtab;
+    str.offset = b->num;
+    str.size = strtab.num;
+    str.align = 1;
+    put_bytes(b, strtab.data, strtab.num);
+
+    ElfSectionHeader& shstr = sections[(unsigned)ElfSection::Shstrtab];
+    shstr.type = SectionTypeStrtab;
+    shstr.offset = b->num;
+    shstr.size = shstrtab.num;
+    shstr.align = 1;
+    put_bytes(b, shstrtab.data, shstrtab.num);
+}
+
+static void add_section_names(DynamicArray<uint8_t>* shstrtab, const ElfFormat& format, ElfSectionHeader* sections)
+{
+    for (unsigned i = 0; i < (unsigned)ElfSection::Num; ++i)
+    {
+        const char* name = i == (unsigned)ElfSection::RelText ? format.relocation_section_name : section_names[i];
+        sections[i].name = add_string(shstrtab, name, (unsigned)strlen(name));
+    }
+}
+
+File elf_build_object(Allocator* allocator, const MachineCode& mc, const SymbolTable& symbols, AsmTarget target)
+{
+    const ElfFormat& format = target == AsmTarget::X86_64 ? elf_format_64 : elf_format_32;
+    Allocator ta = create_temp_allocator();
+    DynamicArray<uint8_t> symtab = dynamic_array_create<uint8_t>(&ta);
+    DynamicArray<uint8_t> strtab = dynamic_array_create<uint8_t>(&ta);
+    DynamicArray<uint8_t> rel = dynamic_array_create<uint8_t>(&ta);
+    DynamicArray<uint8_t> shstrtab = dynamic_array_create<uint8_t>(&ta);
+
+    // Symbol table index of each symbol id, zero for ids that have none yet.
+    uint32_t* symbol_indices = (uint32_t*)ta.alloc_zero(sizeof(uint32_t) * (symbols.symbols.num + 1));
+
+    add_string(&strtab, "", 0);
+    put_symbol(&symtab, format, 0, 0, 0, SymbolBindLocal, SymbolTypeNone, 0);
+    put_symbol(&symtab, format, 0, 0, 0, SymbolBindLocal, SymbolTypeSection, (uint16_t)ElfSection::Text);
+    const uint32_t first_global_symbol = 2;
+    uint32_t num_symbols = first_global_symbol;
+
+    for (unsigned i = 0; i < mc.symbols.num; ++i)
+    {
+        const MachineCodeSymbol& s = mc.symbols[i];
+        const uint32_t name = add_string(&strtab, symbol_str(symbols, s.name_symbol), symbol_len(symbols, s.name_symbol));
+        put_symbol(&symtab, format, name, s.offset, s.size, SymbolBindGlobal, SymbolTypeFunc, (uint16_t)ElfSection::Text);
+        symbol_indices[s.name_symbol] = num_symbols++;
+    }
+
+    for (unsigned i = 0; i < mc.relocations.num; ++i)
+    {
+        const MachineCodeRelocation& r = mc.relocations[i];
+
+        if (symbol_indices[r.target_symbol] == 0)
+        {
+            const uint32_t name = add_string(&strtab, symbol_str(symbols, r.target_symbol), symbol_len(symbols, r.target_symbol));
+            put_symbol(&symtab, format, name, 0, 0, SymbolBindGlobal, SymbolTypeNone, 0);
+            symbol_indices[r.target_symbol] = num_symbols++;
+        }
+
+        // PC32 is relative to the start of the field and the relocations are relative to its end.
+        if (format.is_64_bit)
+        {
+            put_u64(&rel, r.offset);
+            put_u64(&rel, (uint64_t)symbol_indices[r.target_symbol] << 32 | RelocationPc32);
+            put_u64(&rel, (uint64_t)-4);
+        }
+        else
+        {
+            put_u32(&rel, r.offset);
+            put_u32(&rel, symbol_indices[r.target_symbol] << 8 | RelocationPc32);
+        }
+    }
+
+    ElfSectionHeader sections[(unsigned)ElfSection::Num] = {};
+    add_section_names(&shstrtab, format, sections);
+    DynamicArray<uint8_t> b = dynamic_array_create<uint8_t>(allocator);
+
+    for (unsigned i = 0; i < format.header_size; ++i)
+        put_u8(&b, 0);
+
+    put_align(&b, 16);
+    ElfSectionHeader& text = sections[(unsigned)ElfSection::Text];
+    text.type = SectionTypeProgbits;
+    text.flags = SectionFlagAlloc | SectionFlagExecInstr;
+    text.offset = b.num;
+    text.size = mc.code.num;
+    text.align = 16;
+    put_bytes(&b, mc.code.data, mc.code.num);
+
+    // 32 bit relocations are REL, without an explicit addend, so the field holds it.
+    if (!format.is_64_bit)
+    {
+        for (unsigned i = 0; i < mc.relocations.num; ++i)
+            put_u32_at(&b, text.offset + mc.relocations[i].offset, (uint32_t)-4);
+    }
+
+    const unsigned align = format.is_64_bit ? 8 : 4;
+    put_align(&b, align);
+    ElfSectionHeader& rel_text = sections[(unsigned)ElfSection::RelText];
+    rel_text.type = format.relocation_section_type;
+    rel_text.offset = b.num;
+    rel_text.size = rel.num;
+    rel_text.link = (uint32_t)ElfSection::Symtab;
+    rel_text.info = (uint32_t)ElfSection::Text;
+    rel_text.align = align;
+    rel_text.entry_size = format.relocation_size;
+    put_bytes(&b, rel.data, rel.num);
+
+    put_symbol_tables(&b, format, sections, symtab, strtab, first_global_symbol, shstrtab);
+    const uint32_t section_headers_offset = put_section_headers(&b, format, sections, (unsigned)ElfSection::Num);
+    put_elf_header(&b, format, ElfTypeRelocatable, 0, 0, section_headers_offset, (uint16_t)ElfSection::Num, (uint16_t)ElfSection::Shstrtab);
+
+    File f = {};
+    f.data = b.data;
+    f.size = b.num;
+    return f;
+}
+
+// The parts of an object that the linker uses, pointing into the object's data.
+struct LinkObject
+{
+    const char* name;
+    const uint8_t* text;
+    uint32_t text_size;
+    uint16_t text_section;
+    const uint8_t* symtab;
+    uint32_t num_symbols;
+    const char* strtab;
+    uint32_t strtab_size;
+    const uint8_t* rel;
+    uint32_t num_relocations;
+    uint32_t address; // Where text is placed in the executable.
+};
+
+static uint16_t read_u16(const uint8_t* p)
+{
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t read_u32(const uint8_t* p)
+{
+    return (uint32_t)read_u16(p) | (uint32_t)read_u16(p + 2) << 16;
+}
+
+static bool in_file(const File& f, uint32_t offset, uint32_t size)
+{
+    return (uint64_t)offset + size <= f.size;
+}
+
+// Reads the object that elf_build_object writes: 32 bit x86, relocatable, one executable section,
+// one symbol table and at most one REL section for the executable one.
+static bool read_link_object(LinkObject* o, const char* name, const File& f)
+{
+    memset(o, 0, sizeof(LinkObject));
+    o->name = name;
+    static const uint8_t ident[7] = {0x7f, 'E', 'L', 'F', 1, 1, 1};
+
+    if (f.size < ElfHeaderSize || memcmp(f.data, ident, sizeof(ident)) != 0
+        || read_u16(f.data + 16) != ElfTypeRelocatable || read_u16(f.data + 18) != ElfMachine386)
+    {
+        return false;
+    }
+
+    const uint32_t section_headers_offset = read_u32(f.data + 32);
+    const uint16_t num_sections = read_u16(f.data + 48);
+
+    if (read_u16(f.data + 46) != ElfSectionHeaderSize || !in_file(f, section_headers_offset, num_sections * ElfSectionHeaderSize))
+        return false;
+
+    const uint8_t* sections = f.data + section_headers_offset;
+    uint16_t symtab_section = 0;
+    uint16_t rel_section = 0;
+
+    for (uint16_t i = 1; i < num_sections; ++i)
+    {
+        const uint8_t* sh = sections + i * ElfSectionHeaderSize;
+        const uint32_t type = read_u32(sh + 4);
+
+        if (!in_file(f, read_u32(sh + 16), read_u32(sh + 20)))
+            return false;
+
+        if (type == SectionTypeProgbits && (read_u32(sh + 8) & SectionFlagExecInstr) != 0)
+        {
+            if (o->text_section != 0)
+                return false;
+
+            o->text_section = i;
+            o->text = f.data + read_u32(sh + 16);
+            o->text_size = read_u32(sh + 20);
+        }
+        else if (type == SectionTypeSymtab)
+        {
+            symtab_section = i;
+        }
+        else if (type == SectionTypeRel)
+        {
+            rel_section = i;
+        }
+    }
+
+    if (o->text_section == 0 || symtab_section == 0)
+        return false;
+
+    const uint8_t* sym = sections + symtab_section * ElfSectionHeaderSize;
+    const uint32_t strtab_section = read_u32(sym + 24);
+
+    if (strtab_section >= num_sections)
+        return false;
+
+    const uint8_t* str = sections + strtab_section * ElfSectionHeaderSize;
+    o->symtab = f.data + read_u32(sym + 16);
+    o->num_symbols = read_u32(sym + 20) / ElfSymbolSize;
+    o->strtab = (const char*)f.data + read_u32(str + 16);
+    o->strtab_size = read_u32(str + 20);
+
+    if (rel_section != 0)
+    {
+        const uint8_t* rel = sections + rel_section * ElfSectionHeaderSize;
+
+        if (read_u32(rel + 28) != o->text_section)
+            return false;
+
+        o->rel = f.data + read_u32(rel + 16);
+        o->num_relocations = read_u32(rel + 20) / ElfRelSize;
+    }
+
+    return true;
+}
+
+static const char* symbol_name(const LinkObject& o, const uint8_t* sym, unsigned* len)
+{
+    const uint32_t name = read_u32(sym);
+
+    if (name >= o.strtab_size)
+    {
+        *len = 0;
+        return "";
+    }
+
+    *len = (unsigned)strnlen(o.strtab + name, o.strtab_size - name);
+    return o.strtab + name;
+}
+
+static const uint32_t ExecutableBaseAddress = 0x08048000;
+static const uint32_t SegmentFlagsReadExecute = 0x5;
+static const uint32_t ProgramHeaderTypeLoad = 1;
+
+// call start, then exit with what it returned through the Linux int 0x80 system call.
+static const uint8_t start_stub[] = {
+    0xe8, 0, 0, 0, 0, // call start
+    0x89, 0xc3, // mov ebx, eax
+    0xb8, 1, 0, 0, 0, // mov eax, 1 (exit)
+    0xcd, 0x80 // int 0x80
+};
+static const uint32_t StartStubCallField = 1;
+
+bool elf_link_executable(const char* filename, const LinkInput* inputs, unsigned num_inputs)
+{
+    Allocator ta = create_temp_allocator();
+    LinkObject* objects = (LinkObject*)ta.alloc(sizeof(LinkObject) * num_inputs);
+
+    for (unsigned i = 0; i < num_inputs; ++i)
+    {
+        if (!read_link_object(objects + i, inputs[i].name, inputs[i].file))
+        {
+            printf("%s is not an object that krang can link.\n", inputs[i].name);
+            return false;
+        }
+    }
+
+    // The code of every object is placed in one segment that also holds the headers, after the
+    // start stub.
+    DynamicArray<uint8_t> b = dynamic_array_create<uint8_t>(&ta);
+
+    for (unsigned i = 0; i < ElfHeaderSize + ElfProgramHeaderSize; ++i)
+        put_u8(&b, 0);
+
+    put_align(&b, 16);
+    const uint32_t text_offset = b.num;
+    put_bytes(&b, start_stub, sizeof(start_stub));
+
+    for (unsigned i = 0; i < num_inputs; ++i)
+    {
+        put_align(&b, 16);
+        objects[i].address = ExecutableBaseAddress + b.num;
+        put_bytes(&b, objects[i].text, objects[i].text_size);
+    }
+
+    const uint32_t segment_size = b.num;
+
+    // Global symbols are interned, so each name has one slot for its address.
+    SymbolTable globals;
+    symbol_table_init(&globals, &ta);
+    DynamicArray<uint32_t> addresses = dynamic_array_create<uint32_t>(&ta);
+    DynamicArray<bool> defined = dynamic_array_create<bool>(&ta);
+    DynamicArray<uint8_t> symtab = dynamic_array_create<uint8_t>(&ta);
+    DynamicArray<uint8_t> strtab = dynamic_array_create<uint8_t>(&ta);
+    add_string(&strtab, "", 0);
+    put_symbol(&symtab, elf_format_32, 0, 0, 0, SymbolBindLocal, SymbolTypeNone, 0);
+    put_symbol(&symtab, elf_format_32, add_string(&strtab, "_start", 6), ExecutableBaseAddress + text_offset, sizeof(start_stub), SymbolBindLocal, SymbolTypeFunc, (uint16_t)ElfSection::Text);
+    const uint32_t first_global_symbol = 2;
+    bool ok = true;
+
+    for (unsigned i = 0; i < num_inputs && ok; ++i)
+    {
+        const LinkObject& o = objects[i];
+
+        for (uint32_t s = 1; s < o.num_symbols; ++s)
+        {
+            const uint8_t* sym = o.symtab + s * ElfSymbolSize;
+            const uint16_t section = read_u16(sym + 14);
+
+            if (sym[12] >> 4 != SymbolBindGlobal || section == 0)
+                continue;
+
+            unsigned len;
+            const char* name = symbol_name(o, sym, &len);
+
+            if (section != o.text_section)
+            {
+                printf("%s: Symbol %.*s is not in the code section.\n", o.name, len, name);
+                ok = false;
+                break;
+            }
+
+            const uint32_t id = symbol_intern(&globals, name, len);
+
+            while (addresses.num < globals.symbols.num)
+            {
+                addresses.add(0);
+                defined.add(false);
+            }
+
+            if (defined[id])
+            {
+                printf("%s: Symbol %.*s is defined more than once.\n", o.name, len, name);
+                ok = false;
+                break;
+            }
+
+            defined[id] = true;
+            addresses[id] = o.address + read_u32(sym + 4);
+            put_symbol(&symtab, elf_format_32, add_string(&strtab, name, len), addresses[id], read_u32(sym + 8), SymbolBindGlobal, SymbolTypeFunc, (uint16_t)ElfSection::Text);
+        }
+    }
+
+    const uint32_t start = symbol_intern(&globals, "start", 5);
+
+    if (ok && (start >= defined.num || !defined[start]))
+    {
+        printf("No start function to link the executable to.\n");
+        ok = false;
+    }
+
+    if (ok)
+    {
+        const uint32_t field = text_offset + StartStubCallField;
+        put_u32_at(&b, field, addresses[start] - (ExecutableBaseAddress + field + 4));
+    }
+
+    for (unsigned i = 0; i < num_inputs && ok; ++i)
+    {
+        const LinkObject& o = objects[i];
+
+        for (uint32_t r = 0; r < o.num_relocations; ++r)
+        {
+            const uint8_t* rel = o.rel + r * ElfRelSize;
+            const uint32_t offset = read_u32(rel);
+            const uint32_t info = read_u32(rel + 4);
+            const uint32_t s = info >> 8;
+
+            if ((info & 0xff) != RelocationPc32 || s >= o.num_symbols || (uint64_t)offset + 4 > o.text_size)
+            {
+                printf("%s: Unsupported relocation.\n", o.name);
+                ok = false;
+                break;
+            }
+
+            const uint8_t* sym = o.symtab + s * ElfSymbolSize;
+            uint32_t target;
+
+            if (sym[12] >> 4 == SymbolBindLocal)
+            {
+                target = o.address + read_u32(sym + 4);
+            }
+            else
+            {
+                unsigned len;
+                const char* name = symbol_name(o, sym, &len);
+                const uint32_t id = symbol_intern(&globals, name, len);
+
+                if (id >= defined.num || !defined[id])
+                {
+                    printf("%s: Undefined symbol %.*s.\n", o.name, len, name);
+                    ok = false;
+                    break;
+                }
+
+                target = addresses[id];
+            }
+
+            // S + A - P, with the addend in the field.
+            const uint32_t field = o.address - ExecutableBaseAddress + offset;
+            const uint32_t addend = read_u32(b.data + field);
+            put_u32_at(&b, field, target + addend - (ExecutableBaseAddress + field));
+        }
+    }
+
+    symbol_table_destroy(&globals);
+
+    if (!ok)
+        return false;
+
+    // The symbols aren't needed to run, they're there for debuggers and disassemblers.
+    DynamicArray<uint8_t> shstrtab = dynamic_array_create<uint8_t>(&ta);
+    ElfSectionHeader sections[(unsigned)ElfSection::Num] = {};
+    add_section_names(&shstrtab, elf_format_32, sections);
+    ElfSectionHeader& text = sections[(unsigned)ElfSection::Text];
+    text.type = SectionTypeProgbits;
+    text.flags = SectionFlagAlloc | SectionFlagExecInstr;
+    text.address = ExecutableBaseAddress + text_offset;
+    text.offset = text_offset;
+    text.size = segment_size - text_offset;
+    text.align = 16;
+    put_symbol_tables(&b, elf_format_32, sections, symtab, strtab, first_global_symbol, shstrtab);
+
+    // There are no relocations left, the empty section only keeps the section numbers the same as
+    // in objects.
+    ElfSectionHeader& rel_text = sections[(unsigned)ElfSection::RelText];
+    rel_text.type = SectionTypeRel;
+    rel_text.link = (uint32_t)ElfSection::Symtab;
+    rel_text.info = (uint32_t)ElfSection::Text;
+    rel_text.align = 4;
+    rel_text.entry_size = ElfRelSize;
+
+    const uint32_t section_headers_offset = put_section_headers(&b, elf_format_32, sections, (unsigned)ElfSection::Num);
+    put_elf_header(&b, elf_format_32, ElfTypeExecutable, ExecutableBaseAddress + text_offset, 1, section_headers_offset, (uint16_t)ElfSection::Num, (uint16_t)ElfSection::Shstrtab);
+
+    DynamicArray<uint8_t> program_header = dynamic_array_create<uint8_t>(&ta);
+    put_u32(&program_header, ProgramHeaderTypeLoad);
+    put_u32(&program_header, 0);
+    put_u32(&program_header, ExecutableBaseAddress);
+    put_u32(&program_header, ExecutableBaseAddress);
+    put_u32(&program_header, segment_size);
+    put_u32(&program_header, segment_size);
+    put_u32(&program_header, SegmentFlagsReadExecute);
+    put_u32(&program_header, 0x1000);
+    memcpy(b.data + ElfHeaderSize, program_header.data, program_header.num);
+
+    return file_write(b.data, b.num, filename);
+}
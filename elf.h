@@ -0,0 +1,24 @@
+#pragma once
+#include "file.h"
+
+struct Allocator;
+struct MachineCode;
+struct SymbolTable;
+enum struct AsmTarget : uint8_t;
+
+// Builds the machine code as an ELF relocatable object for target, 32 bit for X86 and 64 bit for
+// X86_64, in memory from allocator. The code goes into .text, each MachineCodeSymbol becomes a
+// global function symbol and each relocation a PC32 one. Targets of relocations that aren't
+// defined in the code become undefined symbols.
+File elf_build_object(Allocator* allocator, const MachineCode& mc, const SymbolTable& symbols, AsmTarget target);
+
+struct LinkInput
+{
+    const char* name; // For error messages.
+    File file;
+};
+
+// Links objects from elf_build_object into a static 32 bit x86 Linux executable. The entry point
+// is a stub that calls start and exits with what it returns. Prints what went wrong and returns
+// false on undefined, duplicate or missing symbols.
+bool elf_link_executable(const char* filename, const LinkInput* inputs, unsigned num_inputs);
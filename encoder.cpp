@@ -0,0 +1,300 @@
+#include "encoder.h"
+#include "asm_instruction.h"
+#include "memory.h"
+
+// The encodings are the ones nasm picks for the same instructions, so that the machine code
+// disassembles to the asm the translator renders.
+
+void machine_code_init(MachineCode* mc, Allocator* allocator)
+{
+    mc->code = dynamic_array_create<uint8_t>(allocator);
+    mc->symbols = dynamic_array_create<MachineCodeSymbol>(allocator);
+    mc->relocations = dynamic_array_create<MachineCodeRelocation>(allocator);
+}
+
+void machine_code_destroy(MachineCode* mc)
+{
+    dynamic_array_destroy(&mc->relocations);
+    dynamic_array_destroy(&mc->symbols);
+    dynamic_array_destroy(&mc->code);
+}
+
+static void emit_byte(MachineCode* out, uint8_t b)
+{
+    out->code.add(b);
+}
+
+static void emit_imm32(MachineCode* out, int32_t v)
+{
+    const uint32_t u = (uint32_t)v;
+    emit_byte(out, (uint8_t)u);
+    emit_byte(out, (uint8_t)(u >> 8));
+    emit_byte(out, (uint8_t)(u >> 16));
+    emit_byte(out, (uint8_t)(u >> 24));
+}
+
+static bool fits_int8(int32_t v)
+{
+    return v >= -128 && v <= 127;
+}
+
+// The registers that encode into the ModRM byte, or the opcode, use the low 3 bits of their
+// number. The 4th bit goes into a REX prefix, along with W for 64 bit operands. reg is the register
+// in the reg field, base the one in the r/m field or the opcode, 0 where there is none.
+static void emit_rex(MachineCode* out, bool wide, unsigned reg, unsigned base)
+{
+    const unsigned rex = 0x40 | (wide ? 8 : 0) | (reg >> 3) << 2 | base >> 3;
+
+    if (rex != 0x40)
+        emit_byte(out, (uint8_t)rex);
+}
+
+static unsigned rm_base(const AsmOperand& rm)
+{
+    return rm.type == AsmOperand::Type::Register || rm.type == AsmOperand::Type::Memory ? (unsigned)rm.reg : 0;
+}
+
+// Emits the ModRM byte, and the SIB byte and displacement that go with it, for rm as the r/m
+// operand. reg is the register operand, or the opcode extension of single operand instructions.
+static void emit_modrm(MachineCode* out, unsigned reg, const AsmOperand& rm)
+{
+    const unsigned base = (unsigned)rm.reg & 7;
+    reg &= 7;
+
+    if (rm.type == AsmOperand::Type::Register)
+    {
+        emit_byte(out, (uint8_t)(0xc0 | reg << 3 | base));
+        return;
+    }
+
+    Assert(rm.type == AsmOperand::Type::Memory, "Error in encoder: Operand can't be used as r/m.");
+
+    // [ebp] and [r13] have no encoding without displacement, the slot means disp32 only.
+    unsigned mod = 2;
+
+    if (rm.value == 0 && base != (unsigned)AsmRegister::Ebp)
+        mod = 0;
+    else if (fits_int8(rm.value))
+        mod = 1;
+
+    emit_byte(out, (uint8_t)(mod << 6 | reg << 3 | base));
+
+    // An r/m of esp or r12 means a SIB byte follows, with it as base and no index.
+    if (base == (unsigned)AsmRegister::Esp)
+        emit_byte(out, 0x24);
+
+    if (mod == 1)
+        emit_byte(out, (uint8_t)rm.value);
+    else if (mod == 2)
+        emit_imm32(out, rm.value);
+}
+
+// An instruction with a ModRM byte, REX prefix included.
+static void emit_op_modrm(MachineCode* out, bool wide, uint8_t opcode, unsigned reg, const AsmOperand& rm)
+{
+    emit_rex(out, wide, reg, rm_base(rm));
+    emit_byte(out, opcode);
+    emit_modrm(out, reg, rm);
+}
+
+// add and sub, which only differ in the opcode extension.
+static void encode_alu(MachineCode* out, const AsmInstruction& in, bool wide, unsigned extension)
+{
+    const AsmOperand& dst = in.dst;
+    const AsmOperand& src = in.src;
+
+    if (src.type == AsmOperand::Type::Immediate)
+    {
+        if (fits_int8(src.value))
+        {
+            emit_op_modrm(out, wide, 0x83, extension, dst);
+            emit_byte(out, (uint8_t)src.value);
+        }
+        else if (dst.type == AsmOperand::Type::Register && dst.reg == AsmRegister::Eax)
+        {
+            emit_rex(out, wide, 0, 0);
+            emit_byte(out, (uint8_t)(extension << 3 | 0x05));
+            emit_imm32(out, src.value);
+        }
+        else
+        {
+            emit_op_modrm(out, wide, 0x81, extension, dst);
+            emit_imm32(out, src.value);
+        }
+
+        return;
+    }
+
+    if (src.type == AsmOperand::Type::Memory)
+    {
+        emit_op_modrm(out, wide, (uint8_t)(extension << 3 | 0x03), (unsigned)dst.reg, src);
+        return;
+    }
+
+    emit_op_modrm(out, wide, (uint8_t)(extension << 3 | 0x01), (unsigned)src.reg, dst);
+}
+
+static void encode_mov(MachineCode* out, const AsmInstruction& in, bool wide)
+{
+    const AsmOperand& dst = in.dst;
+    const AsmOperand& src = in.src;
+
+    if (src.type == AsmOperand::Type::Immediate)
+    {
+        if (dst.type == AsmOperand::Type::Register)
+        {
+            emit_rex(out, wide, 0, (unsigned)dst.reg);
+            emit_byte(out, (uint8_t)(0xb8 + ((unsigned)dst.reg & 7)));
+        }
+        else
+        {
+            emit_op_modrm(out, wide, 0xc7, 0, dst);
+        }
+
+        emit_imm32(out, src.value);
+        return;
+    }
+
+    if (src.type == AsmOperand::Type::Memory)
+    {
+        Assert(dst.type == AsmOperand::Type::Register, "Error in encoder: Memory to memory mov.");
+        emit_op_modrm(out, wide, 0x8b, (unsigned)dst.reg, src);
+        return;
+    }
+
+    emit_op_modrm(out, wide, 0x89, (unsigned)src.reg, dst);
+}
+
+static bool is_stack_register(const AsmOperand& o)
+{
+    return o.type == AsmOperand::Type::Register && (o.reg == AsmRegister::Esp || o.reg == AsmRegister::Ebp);
+}
+
+static void encode_instruction(MachineCode* out, const AsmInstruction& in, AsmTarget target)
+{
+    // On X86_64 memory operands already use the 64 bit base and push and pop the 64 bit register,
+    // the other instructions need REX.W to move the whole stack and frame pointers.
+    const bool wide = target == AsmTarget::X86_64 && in.op != AsmInstruction::Op::Push && in.op != AsmInstruction::Op::Pop
+        && (is_stack_register(in.dst) || is_stack_register(in.src));
+
+    switch (in.op)
+    {
+        case AsmInstruction::Op::Push:
+            if (in.dst.type == AsmOperand::Type::Register)
+            {
+                emit_rex(out, false, 0, (unsigned)in.dst.reg);
+                emit_byte(out, (uint8_t)(0x50 + ((unsigned)in.dst.reg & 7)));
+            }
+            else if (in.dst.type == AsmOperand::Type::Immediate)
+            {
+                if (fits_int8(in.dst.value))
+                {
+                    emit_byte(out, 0x6a);
+                    emit_byte(out, (uint8_t)in.dst.value);
+                }
+                else
+                {
+                    emit_byte(out, 0x68);
+                    emit_imm32(out, in.dst.value);
+                }
+            }
+            else
+            {
+                emit_op_modrm(out, false, 0xff, 6, in.dst);
+            }
+            break;
+        case AsmInstruction::Op::Pop:
+            if (in.dst.type == AsmOperand::Type::Register)
+            {
+                emit_rex(out, false, 0, (unsigned)in.dst.reg);
+                emit_byte(out, (uint8_t)(0x58 + ((unsigned)in.dst.reg & 7)));
+            }
+            else
+            {
+                emit_op_modrm(out, false, 0x8f, 0, in.dst);
+            }
+            break;
+        case AsmInstruction::Op::Mov:
+            encode_mov(out, in, wide);
+            break;
+        case AsmInstruction::Op::Add:
+            encode_alu(out, in, wide, 0);
+            break;
+        case AsmInstruction::Op::Sub:
+            encode_alu(out, in, wide, 5);
+            break;
+        case AsmInstruction::Op::Imul:
+            Assert(in.dst.type == AsmOperand::Type::Register, "Error in encoder: imul needs a register destination.");
+
+            // imul with an immediate is the three operand form with the destination as source.
+            if (in.src.type == AsmOperand::Type::Immediate)
+            {
+                const bool short_imm = fits_int8(in.src.value);
+                emit_op_modrm(out, wide, short_imm ? 0x6b : 0x69, (unsigned)in.dst.reg, in.dst);
+
+                if (short_imm)
+                    emit_byte(out, (uint8_t)in.src.value);
+                else
+                    emit_imm32(out, in.src.value);
+            }
+            else
+            {
+                emit_rex(out, wide, (unsigned)in.dst.reg, rm_base(in.src));
+                emit_byte(out, 0x0f);
+                emit_byte(out, 0xaf);
+                emit_modrm(out, (unsigned)in.dst.reg, in.src);
+            }
+            break;
+        case AsmInstruction::Op::Neg:
+            emit_op_modrm(out, wide, 0xf7, 3, in.dst);
+            break;
+        case AsmInstruction::Op::Cdq:
+            emit_byte(out, 0x99);
+            break;
+        case AsmInstruction::Op::Idiv:
+            emit_op_modrm(out, wide, 0xf7, 7, in.dst);
+            break;
+        case AsmInstruction::Op::Lea:
+            Assert(in.dst.type == AsmOperand::Type::Register && in.src.type == AsmOperand::Type::Memory, "Error in encoder: Malformed lea.");
+            emit_op_modrm(out, wide, 0x8d, (unsigned)in.dst.reg, in.src);
+            break;
+        case AsmInstruction::Op::Ret:
+            emit_byte(out, 0xc3);
+            break;
+        default:
+            Error("Error in encoder: Unknown instruction.");
+            break;
+    }
+}
+
+void encode_instructions(MachineCode* out, const AsmInstruction* instructions, unsigned num, AsmTarget target)
+{
+    const unsigned first_symbol = out->symbols.num;
+
+    for (unsigned i = 0; i < num; ++i)
+    {
+        const AsmInstruction& in = instructions[i];
+
+        if (in.op == AsmInstruction::Op::Label)
+        {
+            if (out->symbols.num > first_symbol)
+            {
+                MachineCodeSymbol& prev = out->symbols.last();
+                prev.size = out->code.num - prev.offset;
+            }
+
+            MachineCodeSymbol* s = out->symbols.push_init();
+            s->name_symbol = in.symbol;
+            s->offset = out->code.num;
+            continue;
+        }
+
+        encode_instruction(out, in, target);
+    }
+
+    if (out->symbols.num > first_symbol)
+    {
+        MachineCodeSymbol& prev = out->symbols.last();
+        prev.size = out->code.num - prev.offset;
+    }
+}
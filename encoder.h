@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+#include "dynamic_array.h"
+
+struct Allocator;
+struct AsmInstruction;
+enum struct AsmTarget : uint8_t;
+
+// A function in MachineCode::code, named by a symbol of the symbol table.
+struct MachineCodeSymbol
+{
+    uint32_t name_symbol;
+    uint32_t offset;
+    uint32_t size;
+};
+
+// A 32 bit field at offset in code that has to be set to the address of target_symbol, relative
+// to the end of the field, once the code is placed.
+struct MachineCodeRelocation
+{
+    uint32_t offset;
+    uint32_t target_symbol;
+};
+
+struct MachineCode
+{
+    DynamicArray<uint8_t> code;
+    DynamicArray<MachineCodeSymbol> symbols;
+    DynamicArray<MachineCodeRelocation> relocations;
+};
+
+void machine_code_init(MachineCode* mc, Allocator* allocator);
+void machine_code_destroy(MachineCode* mc);
+
+// Appends the x86 encoding of the instructions for target to out. Each Label becomes a symbol that
+// spans up to the next Label, or the end of the instructions.
+void encode_instructions(MachineCode* out, const AsmInstruction* instructions, unsigned num, AsmTarget target);
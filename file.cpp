@@ -1,32 +1,239 @@
 #include "file.h"
-#include "memory.h"
+#include <windows.h>
 #include <stdio.h>
+#include <string.h>
 
-LoadedFile file_load(Allocator* alloc, const char* filename)
+static const DWORD ReadBlockSize = 1024 * 1024;
+
+// Files that aren't mapped are read into buffers of their own instead of an allocator, so their
+// size isn't limited by the permanent memory. They have room for the '\0' after the data.
+static unsigned char* alloc_buffer(uint64_t size)
 {
-    FILE* file_handle = fopen(filename, "rb");
+    if (size >= (size_t)-1)
+        return nullptr;
 
-    if (file_handle == nullptr)
-        return {false};
+    return (unsigned char*)VirtualAlloc(nullptr, (size_t)size + 1, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+}
+
+static LoadedFile loaded_buffer(unsigned char* data, uint64_t size)
+{
+    data[size] = '\0';
+    LoadedFile lf = {};
+    lf.valid = true;
+    lf.file.data = data;
+    lf.file.size = size;
+    lf.buffer = data;
+    return lf;
+}
+
+// For streams of unknown size. Reads into a buffer that is doubled whenever it fills up.
+static LoadedFile read_stream(HANDLE handle)
+{
+    uint64_t capacity = ReadBlockSize;
+    unsigned char* data = alloc_buffer(capacity);
+    uint64_t size = 0;
+
+    while (data != nullptr)
+    {
+        if (size == capacity)
+        {
+            unsigned char* grown = alloc_buffer(capacity * 2);
+
+            if (grown != nullptr)
+                memcpy(grown, data, (size_t)size);
 
-    fseek(file_handle, 0, SEEK_END);
-    unsigned filesize = ftell(file_handle);
-    fseek(file_handle, 0, SEEK_SET);
+            VirtualFree(data, 0, MEM_RELEASE);
+            data = grown;
+            capacity *= 2;
+            continue;
+        }
 
-    if (filesize == 0)
+        const DWORD to_read = capacity - size > ReadBlockSize ? ReadBlockSize : (DWORD)(capacity - size);
+        DWORD read = 0;
+
+        // Treating a failed read as the end would compile what was read so far as if it were all
+        // of the input. Pipes report their end as broken once the writer has closed them.
+        if (!ReadFile(handle, data + size, to_read, &read, nullptr))
+        {
+            if (GetLastError() == ERROR_BROKEN_PIPE)
+                break;
+
+            VirtualFree(data, 0, MEM_RELEASE);
+            return {false};
+        }
+
+        if (read == 0)
+            break;
+
+        size += read;
+    }
+
+    if (data == nullptr)
         return {false};
 
-    unsigned char* data = (unsigned char*)alloc->alloc(unsigned(filesize));
+    if (size == 0)
+    {
+        VirtualFree(data, 0, MEM_RELEASE);
+        return {false};
+    }
+
+    return loaded_buffer(data, size);
+}
+
+static bool read_all(HANDLE handle, unsigned char* dest, uint64_t size)
+{
+    while (size > 0)
+    {
+        const DWORD to_read = size > ReadBlockSize ? ReadBlockSize : (DWORD)size;
+        DWORD read = 0;
+
+        if (!ReadFile(handle, dest, to_read, &read, nullptr) || read == 0)
+            return false;
+
+        dest += read;
+        size -= read;
+    }
+
+    return true;
+}
+
+static LoadedFile read_file(HANDLE handle, uint64_t size)
+{
+    unsigned char* data = alloc_buffer(size);
 
     if (data == nullptr)
         return {false};
 
-    fread(data, 1, filesize, file_handle);
-    fclose(file_handle);
-    File file = {};
-    file.data = data;
-    file.size = filesize;
-    return {true, file};
+    if (!read_all(handle, data, size))
+    {
+        VirtualFree(data, 0, MEM_RELEASE);
+        return {false};
+    }
+
+    return loaded_buffer(data, size);
+}
+
+// When the size is a multiple of the allocation granularity the view can be followed by a page of
+// zeros. Room for both is reserved and released again, and the view and the page are put there.
+// Another thread can take the range in between, so that is tried a few times.
+static void* map_view_before_zero_page(HANDLE mapping, uint64_t size, DWORD page_size, void** zero_page)
+{
+    for (unsigned attempt = 0; attempt < 4; ++attempt)
+    {
+        unsigned char* base = (unsigned char*)VirtualAlloc(nullptr, (size_t)size + page_size, MEM_RESERVE, PAGE_NOACCESS);
+
+        if (base == nullptr)
+            return nullptr;
+
+        VirtualFree(base, 0, MEM_RELEASE);
+        void* view = MapViewOfFileEx(mapping, FILE_MAP_READ, 0, 0, 0, base);
+
+        if (view == nullptr)
+            continue;
+
+        *zero_page = VirtualAlloc(base + size, page_size, MEM_RESERVE|MEM_COMMIT, PAGE_READONLY);
+
+        if (*zero_page != nullptr)
+            return view;
+
+        UnmapViewOfFile(view);
+    }
+
+    return nullptr;
+}
+
+// The part of the last page that is beyond the end of the file reads as zeros, which gives us the
+// '\0' after the data for free. When the size is a multiple of the page size there is no such part,
+// and the view needs a zero page after it.
+static LoadedFile map_file(HANDLE handle, uint64_t size, const SYSTEM_INFO& si)
+{
+    const bool needs_zero_page = size % si.dwPageSize == 0;
+
+    // Views start on allocation granularity boundaries, so nothing can be put right after ones
+    // that end between them.
+    if (needs_zero_page && size % si.dwAllocationGranularity != 0)
+        return {false};
+
+    HANDLE mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+    if (mapping == nullptr)
+        return {false};
+
+    void* zero_page = nullptr;
+    void* view = needs_zero_page
+        ? map_view_before_zero_page(mapping, size, si.dwPageSize, &zero_page)
+        : MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+    if (view == nullptr)
+    {
+        CloseHandle(mapping);
+        return {false};
+    }
+
+    LoadedFile lf = {};
+    lf.valid = true;
+    lf.file.data = (unsigned char*)view;
+    lf.file.size = size;
+    lf.file_handle = handle;
+    lf.mapping_handle = mapping;
+    lf.zero_page = zero_page;
+    return lf;
+}
+
+LoadedFile file_load(const char* filename)
+{
+    if (strcmp(filename, "-") == 0)
+        return read_stream(GetStdHandle(STD_INPUT_HANDLE));
+
+    HANDLE handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+    if (handle == INVALID_HANDLE_VALUE)
+        return {false};
+
+    if (GetFileType(handle) != FILE_TYPE_DISK)
+    {
+        LoadedFile lf = read_stream(handle);
+        CloseHandle(handle);
+        return lf;
+    }
+
+    LARGE_INTEGER filesize = {};
+
+    if (!GetFileSizeEx(handle, &filesize) || filesize.QuadPart == 0 || (uint64_t)filesize.QuadPart >= (size_t)-1)
+    {
+        CloseHandle(handle);
+        return {false};
+    }
+
+    const uint64_t size = (uint64_t)filesize.QuadPart;
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    LoadedFile lf = map_file(handle, size, si);
+
+    if (lf.valid)
+        return lf;
+
+    lf = read_file(handle, size);
+    CloseHandle(handle);
+    return lf;
+}
+
+void file_unload(LoadedFile* lf)
+{
+    if (lf->mapping_handle != nullptr)
+    {
+        UnmapViewOfFile(lf->file.data);
+        CloseHandle(lf->mapping_handle);
+        CloseHandle(lf->file_handle);
+    }
+
+    if (lf->zero_page != nullptr)
+        VirtualFree(lf->zero_page, 0, MEM_RELEASE);
+
+    if (lf->buffer != nullptr)
+        VirtualFree(lf->buffer, 0, MEM_RELEASE);
+
+    memset(lf, 0, sizeof(LoadedFile));
 }
 
 bool file_write(void* data, size_t size, const char* filename)
@@ -40,3 +247,28 @@ bool file_write(void* data, size_t size, const char* filename)
     fclose(file_handle);
     return true;
 }
+
+FileWriter file_writer_open(const char* filename)
+{
+    FileWriter fw = {};
+    fw.handle = fopen(filename, "wb");
+    fw.valid = fw.handle != nullptr;
+    return fw;
+}
+
+bool file_writer_append(FileWriter* fw, const void* data, size_t size)
+{
+    if (!fw->valid)
+        return false;
+
+    return fwrite(data, 1, size, (FILE*)fw->handle) == size;
+}
+
+void file_writer_close(FileWriter* fw)
+{
+    if (fw->valid)
+        fclose((FILE*)fw->handle);
+
+    fw->valid = false;
+    fw->handle = nullptr;
+}
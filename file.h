@@ -1,18 +1,38 @@
 #pragma once
+#include <stdint.h>
 
-struct Allocator;
-
+// data is always followed by a '\0', so data[size] can be read. Files loaded through a mapping
+// are read only.
 struct File
 {
     unsigned char* data;
-    size_t size;
+    uint64_t size;
 };
 
 struct LoadedFile
 {
     bool valid;
     File file;
+    void* file_handle;
+    void* mapping_handle;
+    void* zero_page; // Follows the view when the file ends on a page boundary.
+    void* buffer; // What the file was read into when it isn't mapped.
 };
 
-LoadedFile file_load(Allocator* alloc, const char* filename);
+// Maps the file into memory when it is a regular file, otherwise (pipes, or "-" for stdin) reads
+// it into a buffer of its own.
+LoadedFile file_load(const char* filename);
+void file_unload(LoadedFile* lf);
 bool file_write(void* data, size_t size, const char* filename);
+
+// Writes a file a piece at a time, for output that is produced in order and never needs to be
+// in memory all at once.
+struct FileWriter
+{
+    bool valid;
+    void* handle;
+};
+
+FileWriter file_writer_open(const char* filename);
+bool file_writer_append(FileWriter* fw, const void* data, size_t size);
+void file_writer_close(FileWriter* fw);
@@ -0,0 +1,423 @@
+#include "generator.h"
+#include "memory.h"
+#include "scoped_symbol_table.h"
+#include <stdlib.h>
+
+static unsigned data_type_size(DataType type)
+{
+    switch(type)
+    {
+        case DataType::Int32:
+            return 4;
+            break;
+    }
+
+    Error("No size set for data type.");
+    return 0;
+}
+
+// Scopes are walked with an explicit stack of these instead of recursion, so nesting depth is
+// only limited by memory. Every frame is a scope in the variable table, function_depth is the
+// depth of the scope of the innermost function, so that a function can't see the variables of
+// the function it's nested in. It's zero outside of functions. The variables of a function are
+// collected at the end of local_variable_scratch while its frame is on the stack and moved to
+// GeneratedCode::local_variables when it ends, which keeps them contiguous even if the function
+// has nested functions.
+struct GeneratorScopeFrame
+{
+    uint32_t function_definition_index;
+    unsigned local_variables_start;
+    unsigned local_variables_offset;
+    unsigned function_depth;
+    unsigned next;
+    unsigned end;
+    bool is_function_scope;
+    bool returned; // Statements after a Return are never reached, only nested functions are kept.
+};
+
+struct GeneratorState
+{
+    const Ast* ast;
+    GeneratedCode* gc;
+    GeneratorOptions options;
+    DynamicArray<GeneratorScopeFrame> stack;
+    DynamicArray<LocalVariableData> local_variable_scratch;
+    DynamicArray<LocalVariableLiveRange> live_range_scratch; // Parallel to local_variable_scratch.
+    ScopedSymbolTable variables;
+};
+
+static void push_scope_frame(GeneratorState* gs, ParseScope ps)
+{
+    GeneratorScopeFrame parent = {};
+
+    if (gs->stack.num > 0)
+        parent = gs->stack.last();
+
+    scoped_symbol_table_push_scope(&gs->variables);
+    GeneratorScopeFrame* f = gs->stack.push_init();
+    *f = parent;
+    f->is_function_scope = false;
+    f->next = ps.first;
+    f->end = ps.first + ps.num;
+}
+
+// Finds the local that name_symbol refers to and extends its live range to the chunk that is
+// about to be pushed.
+static unsigned get_variable_declaration_index(GeneratorState* gs, uint32_t name_symbol)
+{
+    uint32_t lvi;
+    const GeneratorScopeFrame& f = gs->stack.last();
+
+    if (!scoped_symbol_table_find(gs->variables, name_symbol, f.function_depth, &lvi))
+        Error("Error in generator: Failed finding variable declaration.");
+
+    gs->live_range_scratch[f.local_variables_start + lvi].end = gs->gc->chunks.num;
+    return lvi;
+}
+
+static AsmExpression lower_expression(GeneratorState* gs, ParseExpression expr)
+{
+    AsmExpression ae = {};
+    ae.first = gs->gc->expression_nodes.num;
+    ae.num = expr.num;
+
+    for (unsigned i = expr.first; i < expr.first + expr.num; ++i)
+    {
+        const ParseExpressionNode& n = gs->ast->expression_nodes[i];
+        AsmExpressionNode* an = gs->gc->expression_nodes.push();
+        an->type = n.type;
+
+        if (n.type == ParseExpressionNode::Type::Variable)
+            an->local_variable_index = get_variable_declaration_index(gs, n.name_symbol);
+        else
+            an->literal = n.literal;
+    }
+
+    return ae;
+}
+
+static void push_chunk(GeneratorState* gs, AsmChunk::Type type, uint32_t index)
+{
+    AsmChunk* c = gs->gc->chunks.push();
+    c->type = type;
+    c->index = index;
+}
+
+static void generate_for_function_defintion(GeneratorState* gs, const ParseFunctionDefinition& fd)
+{
+    const uint32_t fdi = gs->gc->function_definitions.num;
+    AsmChunkFunctionDefinitionData* fdd = gs->gc->function_definitions.push_init();
+    fdd->return_type = fd.return_type;
+    fdd->name_symbol = fd.name_symbol;
+    push_chunk(gs, AsmChunk::Type::FunctionDefinition, fdi);
+    push_scope_frame(gs, fd.scope);
+    GeneratorScopeFrame& f = gs->stack.last();
+    f.function_definition_index = fdi;
+    f.local_variables_start = gs->local_variable_scratch.num;
+    f.local_variables_offset = 0;
+    f.function_depth = scoped_symbol_table_depth(gs->variables);
+    f.is_function_scope = true;
+    f.returned = false;
+}
+
+static int compare_uint64(const void* a, const void* b)
+{
+    const uint64_t x = *(const uint64_t*)a;
+    const uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Registers in the order they are handed out. On X86_64 the caller saved ones come first, since
+// they don't have to be saved and restored.
+static const LocalVariableRegister x86_registers[] = {LocalVariableRegister::Ebx, LocalVariableRegister::Esi, LocalVariableRegister::Edi};
+static const LocalVariableRegister x86_64_registers[] = {
+    LocalVariableRegister::Esi, LocalVariableRegister::Edi, LocalVariableRegister::R8, LocalVariableRegister::R9,
+    LocalVariableRegister::R10, LocalVariableRegister::R11, LocalVariableRegister::Ebx, LocalVariableRegister::R12,
+    LocalVariableRegister::R13, LocalVariableRegister::R14, LocalVariableRegister::R15
+};
+
+static_assert(sizeof(x86_64_registers) / sizeof(x86_64_registers[0]) == (size_t)LocalVariableRegister::Num, "Missing local variable register.");
+
+// Linear scan over the locals in order of the start of their live ranges. A local gets a register
+// that is free at its start, or takes the register of the active local that lives the longest if
+// that one outlives it. Locals that lose out stay on the stack, and get packed stack offsets.
+void allocate_local_variables(LocalVariableData* locals, const LocalVariableLiveRange* ranges, unsigned num_locals, const GeneratorOptions& options)
+{
+    const bool is_64_bit = options.target == AsmTarget::X86_64;
+    const LocalVariableRegister* regs = is_64_bit ? x86_64_registers : x86_registers;
+    const unsigned num_regs = (unsigned)(is_64_bit ? sizeof(x86_64_registers) / sizeof(x86_64_registers[0]) : sizeof(x86_registers) / sizeof(x86_registers[0]));
+    const unsigned no_local = (unsigned)-1;
+    unsigned reg_owners[(unsigned)LocalVariableRegister::Num];
+
+    for (unsigned r = 0; r < num_regs; ++r)
+        reg_owners[r] = no_local;
+
+    // The start of each used local's range in the high bits and its index in the low bits, so
+    // that sorting these sorts the locals by start.
+    Allocator ta = create_temp_allocator();
+    uint64_t* order = (uint64_t*)ta.alloc(sizeof(uint64_t) * (num_locals + 1));
+    unsigned num_used = 0;
+
+    for (unsigned i = 0; i < num_locals; ++i)
+    {
+        if (ranges[i].start > ranges[i].end)
+        {
+            locals[i].storage_type = LocalVariableStorageType::Unused;
+            continue;
+        }
+
+        locals[i].storage_type = LocalVariableStorageType::Stack;
+        order[num_used++] = (uint64_t)ranges[i].start << 32 | i;
+    }
+
+    qsort(order, num_used, sizeof(uint64_t), compare_uint64);
+
+    for (unsigned o = 0; o < num_used && !options.force_stack_variables; ++o)
+    {
+        const unsigned i = (unsigned)order[o];
+
+        if (data_type_size(locals[i].type) != 4)
+            continue;
+
+        // A local whose range ends where this one starts is only read by the chunk that writes
+        // this one, and the value is computed in eax before it's stored, so the two can share.
+        unsigned free_reg = no_local;
+        unsigned longest_reg = no_local;
+
+        for (unsigned r = 0; r < num_regs; ++r)
+        {
+            if (reg_owners[r] != no_local && ranges[reg_owners[r]].end <= ranges[i].start)
+                reg_owners[r] = no_local;
+
+            if (reg_owners[r] == no_local)
+            {
+                if (free_reg == no_local)
+                    free_reg = r;
+            }
+            else if (longest_reg == no_local || ranges[reg_owners[r]].end > ranges[reg_owners[longest_reg]].end)
+                longest_reg = r;
+        }
+
+        unsigned reg = free_reg;
+
+        if (reg == no_local && ranges[reg_owners[longest_reg]].end > ranges[i].end)
+        {
+            reg = longest_reg;
+            locals[reg_owners[reg]].storage_type = LocalVariableStorageType::Stack;
+        }
+
+        if (reg == no_local)
+            continue;
+
+        reg_owners[reg] = i;
+        locals[i].storage_type = LocalVariableStorageType::Register;
+        locals[i].reg = regs[reg];
+    }
+
+    unsigned stack_offset = 0;
+
+    for (unsigned i = 0; i < num_locals; ++i)
+    {
+        if (locals[i].storage_type != LocalVariableStorageType::Stack)
+            continue;
+
+        locals[i].stack_offset = stack_offset + 4;
+        stack_offset += data_type_size(locals[i].type);
+    }
+}
+
+static void generate_for_function_end(GeneratorState* gs, const GeneratorScopeFrame& f)
+{
+    GeneratedCode* gc = gs->gc;
+
+    // With force_stack_variables the offsets given out while walking the scopes are kept, they
+    // reuse the slots of scopes that have ended.
+    if (!gs->options.force_stack_variables)
+    {
+        const unsigned num_locals = gs->local_variable_scratch.num - f.local_variables_start;
+        allocate_local_variables(gs->local_variable_scratch.data + f.local_variables_start, gs->live_range_scratch.data + f.local_variables_start, num_locals, gs->options);
+    }
+
+    AsmChunkFunctionDefinitionData& fdd = gc->function_definitions[f.function_definition_index];
+    fdd.first_local_variable = gc->local_variables.num;
+    fdd.num_local_variables = gs->local_variable_scratch.num - f.local_variables_start;
+
+    for (unsigned i = f.local_variables_start; i < gs->local_variable_scratch.num; ++i)
+        gc->local_variables.add(gs->local_variable_scratch[i]);
+
+    gs->local_variable_scratch.num = f.local_variables_start;
+    gs->live_range_scratch.num = f.local_variables_start;
+    push_chunk(gs, AsmChunk::Type::ScopeEnd, 0);
+}
+
+static void generate_for_scope(GeneratorState* gs, ParseScope root)
+{
+    const Ast& ast = *gs->ast;
+    GeneratedCode* gc = gs->gc;
+    push_scope_frame(gs, root);
+
+    while (gs->stack.num > 0)
+    {
+        GeneratorScopeFrame& f = gs->stack.last();
+
+        if (f.next == f.end)
+        {
+            if (f.is_function_scope)
+                generate_for_function_end(gs, f);
+
+            scoped_symbol_table_pop_scope(&gs->variables);
+            --gs->stack.num;
+            continue;
+        }
+
+        const ParseNode& pn = ast.nodes[f.next++];
+
+        if (f.returned && pn.type != ParseNode::Type::Scope && pn.type != ParseNode::Type::FunctionDefinition)
+            continue;
+
+        switch (pn.type)
+        {
+            case ParseNode::Type::Scope:
+                // Variables of the inner scope go in the function's stack frame after the ones
+                // that are live here, its slots are reused once it ends.
+                push_scope_frame(gs, ast.scopes[pn.index]);
+                break;
+            case ParseNode::Type::FunctionDefinition:
+                generate_for_function_defintion(gs, ast.function_definitions[pn.index]);
+                break;
+            case ParseNode::Type::VariableDeclaration:
+            {
+                Assert(f.function_depth > 0, "Error in generator: Variable declared outside of function.");
+                const ParseVariableDeclaration& vd = ast.variable_declarations[pn.index];
+
+                // Resolved before the new variable is bound, so the initial value of a
+                // redeclaration reads the variable it shadows.
+                AsmExpression initial_value = {};
+
+                if (vd.has_initial_value)
+                    initial_value = lower_expression(gs, vd.value_expr);
+
+                unsigned lvi = gs->local_variable_scratch.num - f.local_variables_start;
+                scoped_symbol_table_bind(&gs->variables, vd.name_symbol, lvi);
+                LocalVariableData* lvd = gs->local_variable_scratch.push_init();
+                lvd->name_symbol = vd.name_symbol;
+                lvd->stack_offset = f.local_variables_offset + 4;
+                f.local_variables_offset += data_type_size(vd.type);
+                lvd->type = vd.type;
+                lvd->storage_type = LocalVariableStorageType::Stack;
+                lvd->is_mutable = vd.is_mutable;
+                LocalVariableLiveRange* lr = gs->live_range_scratch.push();
+                lr->start = gc->chunks.num;
+                lr->end = gc->chunks.num;
+                push_chunk(gs, AsmChunk::Type::VariableDeclaration, gc->variable_declarations.num);
+                AsmChunkVariableDeclarationData* cvd = gc->variable_declarations.push_init();
+                cvd->local_variable_index = lvi;
+                cvd->has_initial_value = vd.has_initial_value;
+                cvd->initial_value = initial_value;
+            } break;
+            case ParseNode::Type::VariableAssignment:
+            {
+                const ParseVariableAssignment& va = ast.variable_assignments[pn.index];
+                unsigned lvi = get_variable_declaration_index(gs, va.name_symbol);
+                const AsmExpression value = lower_expression(gs, va.value_expr);
+                push_chunk(gs, AsmChunk::Type::VariableAssignment, gc->variable_assignments.num);
+                AsmChunkVariableAssignmentData* vad = gc->variable_assignments.push_init();
+                vad->local_variable_index = lvi;
+                vad->value = value;
+            } break;
+            case ParseNode::Type::Return:
+            {
+                const ParseReturn& pr = ast.returns[pn.index];
+                const AsmExpression value = lower_expression(gs, pr.value);
+                push_chunk(gs, AsmChunk::Type::Return, gc->returns.num);
+                gc->returns.push()->value = value;
+
+                // The translator falls through a Return into the epilogue, so the rest of the
+                // function, including the scopes this one is nested in, must not be generated.
+                for (unsigned i = gs->stack.num; i-- > 0;)
+                {
+                    gs->stack[i].returned = true;
+
+                    if (gs->stack[i].is_function_scope)
+                        break;
+                }
+            } break;
+            default:
+                Error("Error in generator: Missing chunk generator for parse node type.");
+                break;
+        }
+    }
+}
+
+template<typename T>
+static DynamicArray<T> create_with_capacity(Allocator* alloc, unsigned capacity)
+{
+    DynamicArray<T> da = dynamic_array_create<T>(alloc);
+    da.data = (T*)alloc->alloc(sizeof(T) * (capacity + 1));
+    da.capacity = capacity + 1;
+    return da;
+}
+
+void generate_nodes(GeneratedCode* gc, const Ast& ast, ParseScope nodes, const GeneratorOptions& options)
+{
+    Allocator ta = create_temp_allocator();
+    GeneratorState gs = {};
+    gs.ast = &ast;
+    gs.gc = gc;
+    gs.options = options;
+    gs.stack = dynamic_array_create<GeneratorScopeFrame>(&ta);
+    gs.local_variable_scratch = dynamic_array_create<LocalVariableData>(&ta);
+    gs.live_range_scratch = dynamic_array_create<LocalVariableLiveRange>(&ta);
+    scoped_symbol_table_init(&gs.variables, &ta);
+    generate_for_scope(&gs, nodes);
+    scoped_symbol_table_destroy(&gs.variables);
+}
+
+void generated_code_init(GeneratedCode* gc, Allocator* allocator)
+{
+    memset(gc, 0, sizeof(GeneratedCode));
+    gc->chunks = dynamic_array_create<AsmChunk>(allocator);
+    gc->function_definitions = dynamic_array_create<AsmChunkFunctionDefinitionData>(allocator);
+    gc->variable_declarations = dynamic_array_create<AsmChunkVariableDeclarationData>(allocator);
+    gc->variable_assignments = dynamic_array_create<AsmChunkVariableAssignmentData>(allocator);
+    gc->returns = dynamic_array_create<AsmChunkReturnData>(allocator);
+    gc->local_variables = dynamic_array_create<LocalVariableData>(allocator);
+    gc->expression_nodes = dynamic_array_create<AsmExpressionNode>(allocator);
+}
+
+void generated_code_clear(GeneratedCode* gc)
+{
+    gc->chunks.num = 0;
+    gc->function_definitions.num = 0;
+    gc->variable_declarations.num = 0;
+    gc->variable_assignments.num = 0;
+    gc->returns.num = 0;
+    gc->local_variables.num = 0;
+    gc->expression_nodes.num = 0;
+}
+
+void generated_code_destroy(GeneratedCode* gc)
+{
+    dynamic_array_destroy(&gc->expression_nodes);
+    dynamic_array_destroy(&gc->local_variables);
+    dynamic_array_destroy(&gc->returns);
+    dynamic_array_destroy(&gc->variable_assignments);
+    dynamic_array_destroy(&gc->variable_declarations);
+    dynamic_array_destroy(&gc->function_definitions);
+    dynamic_array_destroy(&gc->chunks);
+}
+
+GeneratedCode generate(Allocator* allocator, const Ast& ast, const GeneratorOptions& options)
+{
+    // Every table gets its final size up front from the AST, so nothing is copied while growing.
+    GeneratedCode gc = {};
+    gc.chunks = create_with_capacity<AsmChunk>(allocator, ast.function_definitions.num * 2 + ast.variable_declarations.num + ast.variable_assignments.num + ast.returns.num);
+    gc.function_definitions = create_with_capacity<AsmChunkFunctionDefinitionData>(allocator, ast.function_definitions.num);
+    gc.variable_declarations = create_with_capacity<AsmChunkVariableDeclarationData>(allocator, ast.variable_declarations.num);
+    gc.variable_assignments = create_with_capacity<AsmChunkVariableAssignmentData>(allocator, ast.variable_assignments.num);
+    gc.returns = create_with_capacity<AsmChunkReturnData>(allocator, ast.returns.num);
+    gc.local_variables = create_with_capacity<LocalVariableData>(allocator, ast.variable_declarations.num);
+    gc.expression_nodes = create_with_capacity<AsmExpressionNode>(allocator, ast.expression_nodes.num);
+    generate_nodes(&gc, ast, ast.root, options);
+    return gc;
+}
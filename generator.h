@@ -1,79 +1,150 @@
 #pragma once
 #include "data_type.h"
 #include "parser.h"
+#include "asm_instruction.h"
 
 enum struct LocalVariableStorageType
 {
-    Stack
-    // Add registers here
+    Stack,
+    Register,
+    Unused // Never read or written, so it needs no storage.
 };
 
-struct AsmChunk;
+// Registers that locals are allocated to, eax, ecx and edx are used by the translator to evaluate
+// expressions. X86 only has ebx, esi and edi. A function saves the callee saved ones it uses in its
+// prologue, below the saved ebp, and its stack variables come after them.
+enum struct LocalVariableRegister : uint8_t
+{
+    Ebx,
+    Esi,
+    Edi,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15,
+    Num
+};
 
 struct LocalVariableData
 {
-    char* name;
-    unsigned name_len;
-    unsigned stack_offset; // only used for stack variables
+    uint32_t name_symbol;
+    unsigned stack_offset; // only used for stack variables, relative to the saved registers
     bool is_mutable;
     DataType type;
     LocalVariableStorageType storage_type;
+    LocalVariableRegister reg; // only used for register variables
 };
 
-struct AsmChunkVariableDeclarationData
+// An expression in postfix order like ParseExpression, but with its variables resolved to local
+// variable indices. Its nodes are GeneratedCode::expression_nodes[first] and on.
+struct AsmExpressionNode
 {
-    unsigned local_variable_index;
-    bool has_initial_value;
-    ParseExpression initial_value;
+    ParseExpressionNode::Type type;
+
+    union
+    {
+        int32_t literal;
+        uint32_t local_variable_index;
+    };
 };
 
-struct AsmChunkScopeData
+struct AsmExpression
 {
-    DynamicArray<AsmChunk> chunks;
+    uint32_t first;
+    uint32_t num;
 };
 
+struct AsmChunkVariableDeclarationData
+{
+    unsigned local_variable_index;
+    bool has_initial_value;
+    AsmExpression initial_value;
+};
+
+// The function's local variables are GeneratedCode::local_variables[first_local_variable] and on,
+// local variable indices in the function's chunks are relative to first_local_variable.
 struct AsmChunkFunctionDefinitionData
 {
-    char* name;
-    unsigned name_len;
+    uint32_t name_symbol;
     DataType return_type;
-    DynamicArray<LocalVariableData> local_variables;
-    AsmChunkScopeData scope_data;
+    uint32_t first_local_variable;
+    uint32_t num_local_variables;
 };
 
 struct AsmChunkVariableAssignmentData
 {
     unsigned local_variable_index;
-    ParseExpression value;
+    AsmExpression value;
 };
 
 struct AsmChunkReturnData
 {
-    ParseExpression value;
+    AsmExpression value;
 };
 
+// Chunks form one flat stream, a function's chunks follow its FunctionDefinition chunk and end
+// with a ScopeEnd chunk. Chunks only hold their type and an index into the side table of that
+// type in GeneratedCode, so the stream is 8 bytes per chunk no matter how big the payloads are.
 struct AsmChunk
 {
-    enum struct Type
+    enum struct Type : uint32_t
     {
         FunctionDefinition,
-        Scope,
         ScopeEnd,
         VariableDeclaration,
         VariableAssignment,
-        SecondPassParseNode,
         Return
     };
 
     Type type;
+    uint32_t index;
+};
 
-    union
-    {
-        AsmChunkFunctionDefinitionData function_definition;
-        AsmChunkVariableDeclarationData variable_declaration;
-        AsmChunkVariableAssignmentData variable_assignment;
-        AsmChunkScopeData scope;
-        AsmChunkReturnData ret;
-        ParseNode second_pass_parse_node;
-    };
+struct GeneratedCode
+{
+    DynamicArray<AsmChunk> chunks;
+    DynamicArray<AsmChunkFunctionDefinitionData> function_definitions;
+    DynamicArray<AsmChunkVariableDeclarationData> variable_declarations;
+    DynamicArray<AsmChunkVariableAssignmentData> variable_assignments;
+    DynamicArray<AsmChunkReturnData> returns;
+    DynamicArray<LocalVariableData> local_variables;
+    DynamicArray<AsmExpressionNode> expression_nodes;
 };
+
+struct GeneratorOptions
+{
+    // Keeps every local in the stack frame instead of allocating registers, for debugging.
+    bool force_stack_variables;
+
+    // Decides which registers locals can be allocated to.
+    AsmTarget target;
+};
+
+struct Allocator;
+
+// A function's chunks run in order, so a local is live from the first chunk that reads or writes it
+// to the last one. Positions only need to be ordered within the function. A local that is never
+// used has start > end.
+struct LocalVariableLiveRange
+{
+    uint32_t start;
+    uint32_t end;
+};
+
+// Gives the locals of one function their storage: a register of the target, a stack offset, or none
+// if they are unused. With force_stack_variables every used local goes on the stack.
+void allocate_local_variables(LocalVariableData* locals, const LocalVariableLiveRange* ranges, unsigned num_locals, const GeneratorOptions& options);
+
+// Lowers the AST to chunks in a single walk.
+GeneratedCode generate(Allocator* allocator, const Ast& ast, const GeneratorOptions& options);
+
+// Lowers a range of nodes of the root scope, appending to gc. Used to generate functions
+// independently of each other.
+void generate_nodes(GeneratedCode* gc, const Ast& ast, ParseScope nodes, const GeneratorOptions& options);
+void generated_code_init(GeneratedCode* gc, Allocator* allocator);
+void generated_code_clear(GeneratedCode* gc);
+void generated_code_destroy(GeneratedCode* gc);
@@ -0,0 +1,120 @@
+#include "jit.h"
+#include <windows.h>
+#include <stdio.h>
+#include "memory.h"
+#include "encoder.h"
+#include "symbol_table.h"
+
+static const uint32_t Undefined = 0xffffffff;
+
+// The code is called through a stub that saves rsi and rdi around the call to start, since the
+// System V ABI lets start use them and the Windows one doesn't. It also keeps rsp 16 byte aligned
+// at the call. The code follows the stub, aligned to 16. Windows has no red zone either, anything
+// below rsp can be overwritten at any time, so the code is translated with no_red_zone.
+static const uint8_t entry_stub[] = {
+    0x56, // push rsi
+    0x57, // push rdi
+    0x48, 0x83, 0xec, 0x08, // sub rsp, 8
+    0xe8, 0, 0, 0, 0, // call start
+    0x48, 0x83, 0xc4, 0x08, // add rsp, 8
+    0x5f, // pop rdi
+    0x5e, // pop rsi
+    0xc3 // ret
+};
+
+static const uint32_t EntryStubCallField = 7;
+static const uint32_t CodeOffset = 32;
+static_assert(sizeof(entry_stub) <= CodeOffset, "Entry stub overlaps the code.");
+
+static bool is_start(const SymbolTable& symbols, uint32_t symbol)
+{
+    return symbol_len(symbols, symbol) == 5 && str_equal(symbol_str(symbols, symbol), "start", 5);
+}
+
+bool jit_load(JitCode* jc, const MachineCode& mc, const SymbolTable& symbols)
+{
+    *jc = {};
+    Allocator ta = create_temp_allocator();
+
+    // The offset in the code of each defined function, by symbol id.
+    const size_t offsets_size = sizeof(uint32_t) * symbols.symbols.num;
+    uint32_t* offsets = (uint32_t*)ta.alloc(offsets_size);
+    memset(offsets, 0xff, offsets_size);
+    uint32_t start = Undefined;
+
+    for (unsigned i = 0; i < mc.symbols.num; ++i)
+    {
+        const MachineCodeSymbol& s = mc.symbols[i];
+
+        if (offsets[s.name_symbol] != Undefined)
+        {
+            printf("Symbol %.*s is defined more than once.\n", symbol_len(symbols, s.name_symbol), symbol_str(symbols, s.name_symbol));
+            return false;
+        }
+
+        offsets[s.name_symbol] = s.offset;
+
+        if (is_start(symbols, s.name_symbol))
+            start = s.offset;
+    }
+
+    if (start == Undefined)
+    {
+        printf("No start function to run.\n");
+        return false;
+    }
+
+    // Written to as read-write memory and only made executable once it's done, so it's never both.
+    const size_t size = CodeOffset + mc.code.num;
+    uint8_t* memory = (uint8_t*)VirtualAlloc(nullptr, size, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+
+    if (memory == nullptr)
+    {
+        printf("Failed allocating memory for the code.\n");
+        return false;
+    }
+
+    uint8_t* code = memory + CodeOffset;
+    memcpy(memory, entry_stub, sizeof(entry_stub));
+    const int32_t start_displacement = (int32_t)(CodeOffset + start - (EntryStubCallField + 4));
+    memcpy(memory + EntryStubCallField, &start_displacement, 4);
+    memcpy(code, mc.code.data, mc.code.num);
+
+    for (unsigned i = 0; i < mc.relocations.num; ++i)
+    {
+        const MachineCodeRelocation& r = mc.relocations[i];
+        const uint32_t target = offsets[r.target_symbol];
+
+        if (target == Undefined)
+        {
+            printf("Undefined symbol %.*s.\n", symbol_len(symbols, r.target_symbol), symbol_str(symbols, r.target_symbol));
+            VirtualFree(memory, 0, MEM_RELEASE);
+            return false;
+        }
+
+        const int32_t displacement = (int32_t)(target - (r.offset + 4));
+        memcpy(code + r.offset, &displacement, 4);
+    }
+
+    DWORD old_protect;
+
+    if (!VirtualProtect(memory, size, PAGE_EXECUTE_READ, &old_protect))
+    {
+        printf("Failed making the code executable.\n");
+        VirtualFree(memory, 0, MEM_RELEASE);
+        return false;
+    }
+
+    FlushInstructionCache(GetCurrentProcess(), memory, size);
+    jc->memory = memory;
+    jc->start = (JitFunction)memory;
+    return true;
+}
+
+void jit_unload(JitCode* jc)
+{
+    if (jc->memory != nullptr)
+        VirtualFree(jc->memory, 0, MEM_RELEASE);
+
+    *jc = {};
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <stdint.h>
+
+struct MachineCode;
+struct SymbolTable;
+
+typedef int32_t(*JitFunction)();
+
+// Machine code placed in executable memory, with the calls between its functions resolved. start
+// calls the start function of the code.
+struct JitCode
+{
+    void* memory;
+    JitFunction start;
+};
+
+// Copies machine code encoded for AsmTarget::X86_64 into executable memory and finds its start
+// function. Prints what went wrong and returns false on undefined, duplicate or missing symbols.
+bool jit_load(JitCode* jc, const MachineCode& mc, const SymbolTable& symbols);
+void jit_unload(JitCode* jc);
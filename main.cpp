@@ -3,13 +3,63 @@
 #include <stdio.h>
 #include "file.h"
 #include "tokenizer.h"
+#include "symbol_table.h"
 #include "parser.h"
-#include "generator.h"
-#include "generator_first_pass.h"
-#include "generator_second_pass.h"
-#include "translator.h"
+#include "backend.h"
+#include "elf.h"
+#include "jit.h"
+#include "timer.h"
 
-const static char* usage_string = "Usage: krang.exe input.kra";
+const static char* usage_string =
+    "Usage: krang.exe [--stream-tokens | --stream-functions] [--stack-variables] [--no-optimizer]\n"
+    "    [--no-constant-propagation] [--no-copy-propagation] [--no-dead-store-elimination]\n"
+    "    [--no-dead-code-elimination] [--no-peephole] [--no-peephole-rule=<name>] [--optimizer-stats]\n"
+    "    [--target=<x86 | x86-64>] [--emit-asm | --nasm] [--executable [--link-object=<file.o>]... | --run]\n"
+    "    input.kra";
+
+static char* filename_with_extension(Allocator* alloc, const char* filename, const char* extension)
+{
+    char* s = (char*)alloc->alloc(strlen(filename) + strlen(extension) + 1);
+    strcpy(s, filename);
+    strcat(s, extension);
+    return s;
+}
+
+// Links the object that was just compiled, from memory, with the objects in link_objects.
+static bool link(const char* executable_filename, const char* object_filename, const File& object, const DynamicArray<const char*>& link_objects)
+{
+    Allocator ta = create_temp_allocator();
+    LinkInput* inputs = (LinkInput*)ta.alloc(sizeof(LinkInput) * (link_objects.num + 1));
+    LoadedFile* loaded = (LoadedFile*)ta.alloc(sizeof(LoadedFile) * (link_objects.num + 1));
+    inputs[0].name = object_filename;
+    inputs[0].file = object;
+    unsigned num_loaded = 0;
+    bool ok = true;
+
+    for (unsigned i = 0; i < link_objects.num && ok; ++i)
+    {
+        loaded[i] = file_load(link_objects[i]);
+
+        if (!loaded[i].valid)
+        {
+            printf("Failed loading object file %s.\n", link_objects[i]);
+            ok = false;
+            break;
+        }
+
+        ++num_loaded;
+        inputs[i + 1].name = link_objects[i];
+        inputs[i + 1].file = loaded[i].file;
+    }
+
+    if (ok)
+        ok = elf_link_executable(executable_filename, inputs, link_objects.num + 1);
+
+    for (unsigned i = 0; i < num_loaded; ++i)
+        file_unload(loaded + i);
+
+    return ok;
+}
 
 int main(int argc, char** argv)
 {
@@ -20,23 +70,152 @@ int main(int argc, char** argv)
     void* permanent_memory_block = VirtualAlloc(nullptr, PermanentMemorySize, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
     Assert(permanent_memory_block != nullptr, "Failed allocating permanent memory.");
     permanent_memory_blob_init(permanent_memory_block, PermanentMemorySize);
+    Allocator ta = create_temp_allocator();
 
-    if (argc != 2)
+    char* filename = nullptr;
+    bool stream_tokens = false;
+    bool stream_functions = false;
+    bool print_optimizer_stats = false;
+    bool emit_asm = false;
+    bool use_nasm = false;
+    bool link_executable = false;
+    bool run = false;
+    bool target_set = false;
+    DynamicArray<const char*> link_objects = dynamic_array_create<const char*>(&ta);
+    CompileOptions options = {};
+    options.optimizer = optimizer_options_all();
+    options.peephole = peephole_options_all();
+    const char* no_peephole_rule_arg = "--no-peephole-rule=";
+    const size_t no_peephole_rule_arg_len = strlen(no_peephole_rule_arg);
+    const char* link_object_arg = "--link-object=";
+    const size_t link_object_arg_len = strlen(link_object_arg);
+    const char* target_arg = "--target=";
+    const size_t target_arg_len = strlen(target_arg);
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--stream-tokens") == 0)
+        {
+            stream_tokens = true;
+        }
+        else if (strcmp(argv[i], "--stream-functions") == 0)
+        {
+            stream_functions = true;
+        }
+        else if (strcmp(argv[i], "--stack-variables") == 0)
+        {
+            options.generator.force_stack_variables = true;
+        }
+        else if (strcmp(argv[i], "--no-optimizer") == 0)
+        {
+            options.optimizer = {};
+        }
+        else if (strcmp(argv[i], "--no-constant-propagation") == 0)
+        {
+            options.optimizer.constant_propagation = false;
+        }
+        else if (strcmp(argv[i], "--no-copy-propagation") == 0)
+        {
+            options.optimizer.copy_propagation = false;
+        }
+        else if (strcmp(argv[i], "--no-dead-store-elimination") == 0)
+        {
+            options.optimizer.dead_store_elimination = false;
+        }
+        else if (strcmp(argv[i], "--no-dead-code-elimination") == 0)
+        {
+            options.optimizer.dead_code_elimination = false;
+        }
+        else if (strcmp(argv[i], "--no-peephole") == 0)
+        {
+            options.peephole = {};
+        }
+        else if (strncmp(argv[i], no_peephole_rule_arg, no_peephole_rule_arg_len) == 0)
+        {
+            PeepholeRule rule;
+
+            if (!peephole_rule_from_name(argv[i] + no_peephole_rule_arg_len, &rule))
+            {
+                printf(usage_string);
+                return -1;
+            }
+
+            options.peephole.rules[(unsigned)rule] = false;
+        }
+        else if (strcmp(argv[i], "--optimizer-stats") == 0)
+        {
+            print_optimizer_stats = true;
+        }
+        else if (strcmp(argv[i], "--emit-asm") == 0)
+        {
+            emit_asm = true;
+        }
+        else if (strcmp(argv[i], "--nasm") == 0)
+        {
+            use_nasm = true;
+        }
+        else if (strcmp(argv[i], "--executable") == 0)
+        {
+            link_executable = true;
+        }
+        else if (strcmp(argv[i], "--run") == 0)
+        {
+            run = true;
+        }
+        else if (strncmp(argv[i], link_object_arg, link_object_arg_len) == 0)
+        {
+            link_objects.add(argv[i] + link_object_arg_len);
+        }
+        else if (strncmp(argv[i], target_arg, target_arg_len) == 0)
+        {
+            const char* target = argv[i] + target_arg_len;
+
+            if (strcmp(target, "x86") == 0)
+                options.target = AsmTarget::X86;
+            else if (strcmp(target, "x86-64") == 0)
+                options.target = AsmTarget::X86_64;
+            else
+            {
+                printf(usage_string);
+                return -1;
+            }
+
+            target_set = true;
+        }
+        else if (filename == nullptr)
+        {
+            filename = argv[i];
+        }
+        else
+        {
+            printf(usage_string);
+            return -1;
+        }
+    }
+
+    // The code runs in this process, which is 64 bit. The linker and the nasm path are 32 bit only.
+    if (run && !target_set)
+        options.target = AsmTarget::X86_64;
+
+    const bool is_64_bit = options.target == AsmTarget::X86_64;
+
+    if (filename == nullptr || (stream_tokens && stream_functions) || (emit_asm && use_nasm)
+        || (link_executable && use_nasm) || (link_objects.num > 0 && !link_executable) || (run && (use_nasm || link_executable))
+        || (run && !is_64_bit) || (is_64_bit && (use_nasm || link_executable)))
     {
         printf(usage_string);
         return -1;
     }
 
-    char* filename = argv[1];
-
     if (strlen(filename) == 0)
     {
         printf("No input file specified.");
         return -1;
     }
 
+    const double compile_start_time = timer_seconds();
     Allocator perma_alloc = create_permanent_allocator();
-    LoadedFile lf = file_load(&perma_alloc, filename);
+    LoadedFile lf = file_load(filename);
 
     if (!lf.valid)
     {
@@ -44,40 +223,139 @@ int main(int argc, char** argv)
         return -1;
     }
 
-    TokenizerResult tokenizer_result = tokenize((char*)lf.file.data, lf.file.size, &perma_alloc);
-    ParseScope ps = parse(&perma_alloc, tokenizer_result.data, tokenizer_result.num);
-
     Allocator heap_alloc = create_heap_allocator();
-    GeneratedCodeFirstPass cg = generate_first_pass(&heap_alloc, ps);
-    GeneratedCodeSecondPass cg2 = generate_second_pass(&heap_alloc, cg.chunks);
-    AsmTranslationResult tr = translate_to_asm(&heap_alloc, cg2.chunks);
-    
-    Allocator ta = create_temp_allocator();
-    size_t code_filename_len = strlen(filename) + 4;
-    char* code_filename = (char*)ta.alloc(code_filename_len);
-    strcpy(code_filename, filename);
-    strcat(code_filename, ".asm");
-    file_write(tr.data, tr.len, code_filename);
-    heap_alloc.dealloc(tr.data);
-
-    size_t obj_filename_len = strlen(filename) + 4;
-    char* obj_filename = (char*)ta.alloc(obj_filename_len);
-    strcpy(obj_filename, filename);
-    strcat(obj_filename, ".obj");
-
-    const char* asm_format = "nasm -f win32 -o %s %s";
-    size_t asm_cmd_len = strlen(asm_format) + obj_filename_len + code_filename_len;
-    char* asm_cmd = (char*)ta.alloc(asm_cmd_len);
-    sprintf(asm_cmd, asm_format, obj_filename, code_filename);
-    system(asm_cmd);
-
-    const char* link_format = "golink %s";
-    size_t link_cmd_len = strlen(link_format) + obj_filename_len;
-    char* link_cmd = (char*)ta.alloc(link_cmd_len);
-    sprintf(link_cmd, link_format, obj_filename);
-    system(link_cmd);
-   
+    SymbolTable symbols = {};
+    symbol_table_init(&symbols, &heap_alloc);
+    char* code_filename = filename_with_extension(&ta, filename, ".asm");
+
+    // The object is encoded in-process, the asm is only written when asked for, or for nasm to
+    // assemble.
+    options.emit_asm = emit_asm || use_nasm;
+    options.emit_machine_code = !use_nasm;
+
+    // Code that runs in this process runs on a Windows thread, which has no red zone.
+    options.no_red_zone = run;
+    Ast ast = {};
+    CompileStats stats = {};
+    CompileResult result = {};
+    int exit_code = 0;
+
+    if (stream_functions)
+    {
+        // Tokenize, parse and compile one function at a time on this thread, writing its asm
+        // before reading on, so that memory use doesn't grow with the size of the file. Only the
+        // machine code is kept until the end.
+        TokenRing ring;
+        token_ring_start(&ring, (char*)lf.file.data, (size_t)lf.file.size, &heap_alloc, &symbols, true);
+        machine_code_init(&result.machine_code, &heap_alloc);
+        const bool written = compile_stream(&heap_alloc, &ring, symbols, options, &stats, code_filename, &result.machine_code);
+        token_ring_finish(&ring);
+
+        if (!written)
+        {
+            printf("Failed writing output file.");
+            exit_code = -1;
+        }
+    }
+    else if (stream_tokens)
+    {
+        // Parse while the tokenizer runs on another thread, instead of tokenizing everything first.
+        TokenRing ring;
+        token_ring_start(&ring, (char*)lf.file.data, (size_t)lf.file.size, &heap_alloc, &symbols, false);
+        ast = parse_from_ring(&perma_alloc, &ring);
+        token_ring_finish(&ring);
+    }
+    else
+    {
+        TokenizerResult tokenizer_result = tokenize((char*)lf.file.data, (size_t)lf.file.size, &perma_alloc, &symbols);
+        ast = parse(&perma_alloc, tokenizer_result);
+    }
+
+    if (!stream_functions)
+    {
+        result = compile(&heap_alloc, ast, symbols, options, &stats);
+
+        if (options.emit_asm && !file_write(result.asm_text.data, result.asm_text.len, code_filename))
+        {
+            printf("Failed writing output file.");
+            exit_code = -1;
+        }
+    }
+
+    if (run && exit_code == 0)
+    {
+        // Runs start and exits with what it returns, like the linked executable does.
+        JitCode jc;
+
+        if (jit_load(&jc, result.machine_code, symbols))
+        {
+            const double execute_start_time = timer_seconds();
+            exit_code = jc.start();
+            const double execute_end_time = timer_seconds();
+            jit_unload(&jc);
+            printf("start returned %d\n", exit_code);
+            printf("compile: %.3f ms, execute: %.3f ms\n", (execute_start_time - compile_start_time) * 1000.0, (execute_end_time - execute_start_time) * 1000.0);
+        }
+        else
+        {
+            printf("Failed loading code to run.");
+            exit_code = -1;
+        }
+    }
+    else if (options.emit_machine_code && exit_code == 0)
+    {
+        char* object_filename = filename_with_extension(&ta, filename, ".o");
+        File object = elf_build_object(&heap_alloc, result.machine_code, symbols, options.target);
+
+        if (!file_write(object.data, (size_t)object.size, object_filename))
+        {
+            printf("Failed writing object file.");
+            exit_code = -1;
+        }
+        else if (link_executable && !link(filename_with_extension(&ta, filename, ".elf"), object_filename, object, link_objects))
+        {
+            printf("Failed linking executable.");
+            exit_code = -1;
+        }
+
+        heap_alloc.dealloc(object.data);
+    }
+
+    compile_result_destroy(&heap_alloc, &result);
+
+    if (print_optimizer_stats)
+    {
+        printf("constant propagation: %llu instructions removed, %llu loads replaced\n",
+            (unsigned long long)stats.optimizer.constant_propagation_removed, (unsigned long long)stats.optimizer.constant_propagation_loads);
+        printf("copy propagation: %llu loads replaced\n", (unsigned long long)stats.optimizer.copy_propagation_loads);
+        printf("dead store elimination: %llu stores removed\n", (unsigned long long)stats.optimizer.dead_store_elimination_removed);
+        printf("dead code elimination: %llu instructions removed\n", (unsigned long long)stats.optimizer.dead_code_elimination_removed);
+
+        for (unsigned r = 0; r < (unsigned)PeepholeRule::Num; ++r)
+            printf("peephole %s: %llu hits\n", peephole_rule_name((PeepholeRule)r), (unsigned long long)stats.peephole.hits[r]);
+    }
+
+    file_unload(&lf);
+    symbol_table_destroy(&symbols);
+
+    if (use_nasm && exit_code == 0)
+    {
+        char* obj_filename = filename_with_extension(&ta, filename, ".obj");
+
+        const char* asm_format = "nasm -f win32 -o %s %s";
+        size_t asm_cmd_len = strlen(asm_format) + strlen(obj_filename) + strlen(code_filename);
+        char* asm_cmd = (char*)ta.alloc(asm_cmd_len);
+        sprintf(asm_cmd, asm_format, obj_filename, code_filename);
+        system(asm_cmd);
+
+        const char* link_format = "golink %s";
+        size_t link_cmd_len = strlen(link_format) + strlen(obj_filename);
+        char* link_cmd = (char*)ta.alloc(link_cmd_len);
+        sprintf(link_cmd, link_format, obj_filename);
+        system(link_cmd);
+    }
+
     heap_allocator_check_clean(&heap_alloc);
 
-    return 0;
+    return exit_code;
 }
\ No newline at end of file
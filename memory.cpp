@@ -35,7 +35,9 @@ struct PermanentMemoryStorage
     size_t capacity;
 };
 
-static PermanentMemoryStorage pms;
+// The blobs are per thread, so threads never share a bump pointer. Memory allocated by one
+// thread can still be read by others.
+static thread_local PermanentMemoryStorage pms;
 
 void permanent_memory_blob_init(void* start, size_t capacity)
 {
@@ -60,7 +62,7 @@ struct TempMemoryStorage
     size_t capacity;
 };
 
-static TempMemoryStorage tms;
+static thread_local TempMemoryStorage tms;
 
 void temp_memory_blob_init(void* start, size_t capacity)
 {
@@ -55,6 +55,8 @@ void* mem_ptr_add(const void* ptr1, size_t offset);
 void* mem_ptr_sub(const void* ptr1, size_t offset);
 void* mem_align_forward(const void* p, unsigned align);
 
+// Permanent and temp memory are per thread. A thread has to init its blobs before it uses
+// allocators of those kinds.
 void permanent_memory_blob_init(void* start, size_t capacity);
 const size_t PermanentMemorySize = 32 * 1024 * 1024;
 void* permanent_alloc(size_t size, unsigned align = DefaultMemoryAlign);
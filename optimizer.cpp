@@ -0,0 +1,652 @@
+#include "optimizer.h"
+#include "generator.h"
+#include "memory.h"
+
+// The IR of one function is a list of instructions where each instruction is an SSA value, named by
+// its index. Locals are memory that is read with Load and written with Store, so every value is
+// defined exactly once. Expressions stay trees in postfix order: an instruction's operands come
+// before it, and the instructions of the tree that ends at i are first..i. Store, Return and
+// Function (a nested function, whose chunks are kept as they are) are the statements, in order.
+// Functions don't branch, so all instructions are in one block. A function ends at its first
+// Return, the passes don't keep what code after that computes.
+struct IrInstruction
+{
+    enum struct Op : uint8_t
+    {
+        Removed,
+        Const,
+        Load,
+        Negate,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Store,
+        Return,
+        Function
+    };
+
+    Op op;
+    bool is_declaration; // Only used for Store.
+    uint32_t first;
+    uint32_t a;
+    uint32_t b;
+
+    union
+    {
+        int32_t constant;
+        uint32_t local;
+        uint32_t nested_function;
+    };
+};
+
+// Chunks of a nested function in OptimizerState::pending.
+struct IrNestedFunction
+{
+    uint32_t first;
+    uint32_t num;
+};
+
+struct IrFunction
+{
+    uint32_t function_definition_index; // In the code that is being optimized.
+    DynamicArray<IrInstruction> instructions;
+};
+
+// Nested functions are lowered before the function they're nested in, so their chunks wait in
+// pending until that one is lowered and splices them in where they were.
+struct OptimizerState
+{
+    const GeneratedCode* in;
+    GeneratedCode* out;
+    OptimizerOptions options;
+    GeneratorOptions generator;
+    OptimizerStats* stats;
+    DynamicArray<IrFunction> functions; // One per depth of nesting, reused.
+    unsigned depth;
+    DynamicArray<AsmChunk> pending;
+    DynamicArray<IrNestedFunction> nested_functions;
+    DynamicArray<uint32_t> operands;
+};
+
+static bool is_expression(IrInstruction::Op op)
+{
+    return op >= IrInstruction::Op::Const && op <= IrInstruction::Op::Divide;
+}
+
+static bool is_binary(IrInstruction::Op op)
+{
+    return op >= IrInstruction::Op::Add && op <= IrInstruction::Op::Divide;
+}
+
+static IrInstruction::Op ir_op_from_expression_node(ParseExpressionNode::Type type)
+{
+    switch (type)
+    {
+        case ParseExpressionNode::Type::Literal: return IrInstruction::Op::Const;
+        case ParseExpressionNode::Type::Variable: return IrInstruction::Op::Load;
+        case ParseExpressionNode::Type::Negate: return IrInstruction::Op::Negate;
+        case ParseExpressionNode::Type::Add: return IrInstruction::Op::Add;
+        case ParseExpressionNode::Type::Subtract: return IrInstruction::Op::Subtract;
+        case ParseExpressionNode::Type::Multiply: return IrInstruction::Op::Multiply;
+        case ParseExpressionNode::Type::Divide: return IrInstruction::Op::Divide;
+        default: break;
+    }
+
+    Error("Error in optimizer: Unknown expression node type.");
+    return IrInstruction::Op::Removed;
+}
+
+static ParseExpressionNode::Type expression_node_from_ir_op(IrInstruction::Op op)
+{
+    switch (op)
+    {
+        case IrInstruction::Op::Const: return ParseExpressionNode::Type::Literal;
+        case IrInstruction::Op::Load: return ParseExpressionNode::Type::Variable;
+        case IrInstruction::Op::Negate: return ParseExpressionNode::Type::Negate;
+        case IrInstruction::Op::Add: return ParseExpressionNode::Type::Add;
+        case IrInstruction::Op::Subtract: return ParseExpressionNode::Type::Subtract;
+        case IrInstruction::Op::Multiply: return ParseExpressionNode::Type::Multiply;
+        case IrInstruction::Op::Divide: return ParseExpressionNode::Type::Divide;
+        default: break;
+    }
+
+    Error("Error in optimizer: Instruction is not an expression.");
+    return ParseExpressionNode::Type::Literal;
+}
+
+// Appends the tree of expression to the function and returns the index of its root.
+static uint32_t build_expression(OptimizerState* os, IrFunction* fn, AsmExpression expression)
+{
+    DynamicArray<IrInstruction>& ins = fn->instructions;
+    os->operands.num = 0;
+
+    for (unsigned i = expression.first; i < expression.first + expression.num; ++i)
+    {
+        const AsmExpressionNode& n = os->in->expression_nodes[i];
+        const uint32_t index = ins.num;
+        IrInstruction* in = ins.push_init();
+        in->op = ir_op_from_expression_node(n.type);
+        in->first = index;
+
+        if (in->op == IrInstruction::Op::Const)
+            in->constant = n.literal;
+        else if (in->op == IrInstruction::Op::Load)
+            in->local = n.local_variable_index;
+        else if (in->op == IrInstruction::Op::Negate)
+        {
+            in->a = os->operands[--os->operands.num];
+            in->first = ins[in->a].first;
+        }
+        else
+        {
+            in->b = os->operands[--os->operands.num];
+            in->a = os->operands[--os->operands.num];
+            in->first = ins[in->a].first;
+        }
+
+        os->operands.add(index);
+    }
+
+    Assert(os->operands.num == 1, "Error in optimizer: Malformed expression.");
+    return os->operands[0];
+}
+
+static void build_statement(OptimizerState* os, IrFunction* fn, IrInstruction::Op op, uint32_t local, bool is_declaration, AsmExpression value)
+{
+    const uint32_t root = build_expression(os, fn, value);
+    IrInstruction* in = fn->instructions.push_init();
+    in->op = op;
+    in->a = root;
+    in->first = fn->instructions[root].first;
+    in->is_declaration = is_declaration;
+
+    if (op == IrInstruction::Op::Store)
+        in->local = local;
+}
+
+static unsigned function_end(const DynamicArray<IrInstruction>& ins)
+{
+    for (unsigned i = 0; i < ins.num; ++i)
+    {
+        if (ins[i].op == IrInstruction::Op::Return)
+            return i + 1;
+    }
+
+    return ins.num;
+}
+
+static bool fold(IrInstruction::Op op, int32_t a, int32_t b, int32_t* result)
+{
+    // Wraps like the 32 bit instructions would. Divisions that would fault are left to do so.
+    switch (op)
+    {
+        case IrInstruction::Op::Negate: *result = (int32_t)(0u - (uint32_t)a); return true;
+        case IrInstruction::Op::Add: *result = (int32_t)((uint32_t)a + (uint32_t)b); return true;
+        case IrInstruction::Op::Subtract: *result = (int32_t)((uint32_t)a - (uint32_t)b); return true;
+        case IrInstruction::Op::Multiply: *result = (int32_t)((uint32_t)a * (uint32_t)b); return true;
+        case IrInstruction::Op::Divide:
+            if (b == 0 || (a == INT32_MIN && b == -1))
+                return false;
+
+            *result = a / b;
+            return true;
+        default:
+            break;
+    }
+
+    return false;
+}
+
+static void remove_range(DynamicArray<IrInstruction>& ins, unsigned first, unsigned end, uint64_t* removed)
+{
+    for (unsigned i = first; i < end; ++i)
+    {
+        if (ins[i].op == IrInstruction::Op::Removed)
+            continue;
+
+        ins[i].op = IrInstruction::Op::Removed;
+        ++*removed;
+    }
+}
+
+// Sparse conditional constant propagation. Values start out unknown and are lowered to a constant
+// or to overdefined, locals carry the value of their last store. With one block and no branches the
+// only condition is reachability, which ends at the first Return, so a single walk in order reaches
+// the fixed point. Constant subtrees are then replaced by a Const.
+static void propagate_constants(IrFunction* fn, unsigned num_locals, OptimizerStats* stats)
+{
+    DynamicArray<IrInstruction>& ins = fn->instructions;
+    Allocator ta = create_temp_allocator();
+    bool* value_known = (bool*)ta.alloc_zero(ins.num + 1);
+    int32_t* values = (int32_t*)ta.alloc_zero(sizeof(int32_t) * (ins.num + 1));
+    bool* local_known = (bool*)ta.alloc_zero(num_locals + 1);
+    int32_t* locals = (int32_t*)ta.alloc_zero(sizeof(int32_t) * (num_locals + 1));
+    const unsigned end = function_end(ins);
+
+    for (unsigned i = 0; i < end; ++i)
+    {
+        IrInstruction& in = ins[i];
+
+        switch (in.op)
+        {
+            case IrInstruction::Op::Const:
+                value_known[i] = true;
+                values[i] = in.constant;
+                break;
+            case IrInstruction::Op::Load:
+                value_known[i] = local_known[in.local];
+                values[i] = locals[in.local];
+                break;
+            case IrInstruction::Op::Negate:
+                value_known[i] = value_known[in.a] && fold(in.op, values[in.a], 0, values + i);
+                break;
+            case IrInstruction::Op::Add:
+            case IrInstruction::Op::Subtract:
+            case IrInstruction::Op::Multiply:
+            case IrInstruction::Op::Divide:
+                value_known[i] = value_known[in.a] && value_known[in.b] && fold(in.op, values[in.a], values[in.b], values + i);
+                break;
+            case IrInstruction::Op::Store:
+                local_known[in.local] = value_known[in.a];
+                locals[in.local] = values[in.a];
+                break;
+            default:
+                break;
+        }
+    }
+
+    for (unsigned i = 0; i < end; ++i)
+    {
+        IrInstruction& in = ins[i];
+
+        if (!value_known[i] || in.op == IrInstruction::Op::Const || in.op == IrInstruction::Op::Removed)
+            continue;
+
+        if (in.op == IrInstruction::Op::Load)
+            ++stats->constant_propagation_loads;
+
+        remove_range(ins, in.first, i, &stats->constant_propagation_removed);
+        in.op = IrInstruction::Op::Const;
+        in.constant = values[i];
+        in.first = i;
+    }
+}
+
+// After x = y, loads of x read y instead for as long as neither is stored to again. A store is
+// tracked by counting the stores to each local, a copy remembers the count of its source.
+static void propagate_copies(IrFunction* fn, unsigned num_locals, OptimizerStats* stats)
+{
+    DynamicArray<IrInstruction>& ins = fn->instructions;
+    const uint32_t no_copy = (uint32_t)-1;
+    Allocator ta = create_temp_allocator();
+    uint32_t* copy_of = (uint32_t*)ta.alloc(sizeof(uint32_t) * (num_locals + 1));
+    uint32_t* copy_stores = (uint32_t*)ta.alloc(sizeof(uint32_t) * (num_locals + 1));
+    uint32_t* stores = (uint32_t*)ta.alloc_zero(sizeof(uint32_t) * (num_locals + 1));
+    const unsigned end = function_end(ins);
+
+    for (unsigned i = 0; i < num_locals; ++i)
+        copy_of[i] = no_copy;
+
+    for (unsigned i = 0; i < end; ++i)
+    {
+        IrInstruction& in = ins[i];
+
+        if (in.op == IrInstruction::Op::Load)
+        {
+            const uint32_t source = copy_of[in.local];
+
+            if (source != no_copy && stores[source] == copy_stores[in.local])
+            {
+                in.local = source;
+                ++stats->copy_propagation_loads;
+            }
+        }
+        else if (in.op == IrInstruction::Op::Store)
+        {
+            ++stores[in.local];
+            copy_of[in.local] = no_copy;
+            const IrInstruction& value = ins[in.a];
+
+            if (value.op == IrInstruction::Op::Load && value.local != in.local)
+            {
+                copy_of[in.local] = value.local;
+                copy_stores[in.local] = stores[value.local];
+            }
+        }
+    }
+}
+
+// Walks backwards from the end of the function tracking which locals are read before they are
+// written again. A store to a local that isn't is removed, and its value tree is skipped so its
+// loads don't keep earlier stores alive. The tree itself is left to dead code elimination.
+static void eliminate_dead_stores(IrFunction* fn, unsigned num_locals, OptimizerStats* stats)
+{
+    DynamicArray<IrInstruction>& ins = fn->instructions;
+    Allocator ta = create_temp_allocator();
+    bool* live = (bool*)ta.alloc_zero(num_locals + 1);
+
+    for (unsigned i = function_end(ins); i-- > 0;)
+    {
+        IrInstruction& in = ins[i];
+
+        if (in.op == IrInstruction::Op::Load)
+            live[in.local] = true;
+        else if (in.op == IrInstruction::Op::Store)
+        {
+            if (live[in.local])
+            {
+                live[in.local] = false;
+                continue;
+            }
+
+            in.op = IrInstruction::Op::Removed;
+            ++stats->dead_store_elimination_removed;
+            i = in.first;
+        }
+    }
+}
+
+// Removes everything after the first Return except nested functions, and expressions whose value
+// nothing uses.
+static void eliminate_dead_code(IrFunction* fn, OptimizerStats* stats)
+{
+    DynamicArray<IrInstruction>& ins = fn->instructions;
+    Allocator ta = create_temp_allocator();
+    bool* used = (bool*)ta.alloc_zero(ins.num + 1);
+    const unsigned end = function_end(ins);
+
+    for (unsigned i = end; i < ins.num; ++i)
+    {
+        if (ins[i].op != IrInstruction::Op::Function && ins[i].op != IrInstruction::Op::Removed)
+        {
+            ins[i].op = IrInstruction::Op::Removed;
+            ++stats->dead_code_elimination_removed;
+        }
+    }
+
+    for (unsigned i = end; i-- > 0;)
+    {
+        IrInstruction& in = ins[i];
+
+        if (in.op == IrInstruction::Op::Removed || in.op == IrInstruction::Op::Function)
+            continue;
+
+        if (is_expression(in.op) && !used[i])
+        {
+            in.op = IrInstruction::Op::Removed;
+            ++stats->dead_code_elimination_removed;
+            continue;
+        }
+
+        if (in.op == IrInstruction::Op::Const || in.op == IrInstruction::Op::Load)
+            continue;
+
+        used[in.a] = true;
+
+        if (is_binary(in.op))
+            used[in.b] = true;
+    }
+}
+
+static void touch_local(LocalVariableLiveRange* ranges, uint32_t local, uint32_t position)
+{
+    if (ranges[local].start > position)
+        ranges[local].start = position;
+
+    if (ranges[local].end < position)
+        ranges[local].end = position;
+}
+
+// Copies what is left of the tree that ends at root to the expression nodes of out.
+static AsmExpression lower_expression(OptimizerState* os, const IrFunction& fn, uint32_t root, LocalVariableLiveRange* ranges, uint32_t position)
+{
+    GeneratedCode* out = os->out;
+    AsmExpression e = {};
+    e.first = out->expression_nodes.num;
+
+    for (unsigned i = fn.instructions[root].first; i <= root; ++i)
+    {
+        const IrInstruction& in = fn.instructions[i];
+
+        if (in.op == IrInstruction::Op::Removed)
+            continue;
+
+        AsmExpressionNode* n = out->expression_nodes.push();
+        n->type = expression_node_from_ir_op(in.op);
+
+        if (in.op == IrInstruction::Op::Load)
+        {
+            n->local_variable_index = in.local;
+            touch_local(ranges, in.local, position);
+        }
+        else
+            n->literal = in.constant;
+    }
+
+    e.num = out->expression_nodes.num - e.first;
+    return e;
+}
+
+static void add_chunk(DynamicArray<AsmChunk>* chunks, AsmChunk::Type type, uint32_t index)
+{
+    AsmChunk* c = chunks->push();
+    c->type = type;
+    c->index = index;
+}
+
+// Lowers the function to chunks, into pending if it's nested and otherwise straight into out.
+static void lower_function(OptimizerState* os, const IrFunction& fn, DynamicArray<AsmChunk>* chunks)
+{
+    GeneratedCode* out = os->out;
+    const AsmChunkFunctionDefinitionData& in_fdd = os->in->function_definitions[fn.function_definition_index];
+    const uint32_t fdi = out->function_definitions.num;
+    AsmChunkFunctionDefinitionData* fdd = out->function_definitions.push();
+    *fdd = in_fdd;
+    fdd->first_local_variable = out->local_variables.num;
+
+    for (unsigned i = 0; i < in_fdd.num_local_variables; ++i)
+        out->local_variables.add(os->in->local_variables[in_fdd.first_local_variable + i]);
+
+    Allocator ta = create_temp_allocator();
+    LocalVariableLiveRange* ranges = (LocalVariableLiveRange*)ta.alloc(sizeof(LocalVariableLiveRange) * (in_fdd.num_local_variables + 1));
+
+    for (unsigned i = 0; i < in_fdd.num_local_variables; ++i)
+    {
+        ranges[i].start = (uint32_t)-1;
+        ranges[i].end = 0;
+    }
+
+    add_chunk(chunks, AsmChunk::Type::FunctionDefinition, fdi);
+    uint32_t position = 1;
+
+    for (unsigned i = 0; i < fn.instructions.num; ++i)
+    {
+        const IrInstruction& in = fn.instructions[i];
+
+        switch (in.op)
+        {
+            case IrInstruction::Op::Store:
+            {
+                const AsmExpression value = lower_expression(os, fn, in.a, ranges, position);
+                touch_local(ranges, in.local, position);
+
+                if (in.is_declaration)
+                {
+                    add_chunk(chunks, AsmChunk::Type::VariableDeclaration, out->variable_declarations.num);
+                    AsmChunkVariableDeclarationData* vd = out->variable_declarations.push_init();
+                    vd->local_variable_index = in.local;
+                    vd->has_initial_value = true;
+                    vd->initial_value = value;
+                }
+                else
+                {
+                    add_chunk(chunks, AsmChunk::Type::VariableAssignment, out->variable_assignments.num);
+                    AsmChunkVariableAssignmentData* va = out->variable_assignments.push_init();
+                    va->local_variable_index = in.local;
+                    va->value = value;
+                }
+
+                ++position;
+            } break;
+            case IrInstruction::Op::Return:
+            {
+                const AsmExpression value = lower_expression(os, fn, in.a, ranges, position);
+                add_chunk(chunks, AsmChunk::Type::Return, out->returns.num);
+                out->returns.push()->value = value;
+                ++position;
+            } break;
+            case IrInstruction::Op::Function:
+            {
+                const IrNestedFunction nf = os->nested_functions[in.nested_function];
+
+                // chunks can be pending itself, so copy by value, add can move the array.
+                for (unsigned c = nf.first; c < nf.first + nf.num; ++c)
+                {
+                    const AsmChunk chunk = os->pending[c];
+                    chunks->add(chunk);
+                }
+
+                ++position;
+            } break;
+            default:
+                break;
+        }
+    }
+
+    add_chunk(chunks, AsmChunk::Type::ScopeEnd, 0);
+    fdd->num_local_variables = in_fdd.num_local_variables;
+    allocate_local_variables(out->local_variables.data + fdd->first_local_variable, ranges, fdd->num_local_variables, os->generator);
+}
+
+static void optimize_function(OptimizerState* os, IrFunction* fn)
+{
+    const unsigned num_locals = os->in->function_definitions[fn->function_definition_index].num_local_variables;
+
+    if (os->options.constant_propagation)
+        propagate_constants(fn, num_locals, os->stats);
+
+    if (os->options.copy_propagation)
+        propagate_copies(fn, num_locals, os->stats);
+
+    if (os->options.dead_store_elimination)
+        eliminate_dead_stores(fn, num_locals, os->stats);
+
+    if (os->options.dead_code_elimination)
+        eliminate_dead_code(fn, os->stats);
+}
+
+static void end_function(OptimizerState* os)
+{
+    IrFunction* fn = &os->functions[os->depth - 1];
+    optimize_function(os, fn);
+    --os->depth;
+
+    if (os->depth == 0)
+    {
+        lower_function(os, *fn, &os->out->chunks);
+        os->pending.num = 0;
+        os->nested_functions.num = 0;
+        return;
+    }
+
+    IrNestedFunction nf = {};
+    nf.first = os->pending.num;
+    lower_function(os, *fn, &os->pending);
+    nf.num = os->pending.num - nf.first;
+    IrInstruction* in = os->functions[os->depth - 1].instructions.push_init();
+    in->op = IrInstruction::Op::Function;
+    in->nested_function = os->nested_functions.num;
+    os->nested_functions.add(nf);
+}
+
+void optimize(GeneratedCode* gc, const OptimizerOptions& options, const GeneratorOptions& generator, OptimizerStats* stats)
+{
+    Allocator* allocator = gc->chunks.allocator;
+    GeneratedCode out;
+    generated_code_init(&out, allocator);
+
+    Allocator ta = create_temp_allocator();
+    OptimizerState os = {};
+    os.in = gc;
+    os.out = &out;
+    os.options = options;
+    os.generator = generator;
+    os.stats = stats;
+    os.functions = dynamic_array_create<IrFunction>(&ta);
+    os.pending = dynamic_array_create<AsmChunk>(&ta);
+    os.nested_functions = dynamic_array_create<IrNestedFunction>(&ta);
+    os.operands = dynamic_array_create<uint32_t>(&ta);
+
+    for (unsigned i = 0; i < gc->chunks.num; ++i)
+    {
+        const AsmChunk& c = gc->chunks[i];
+        IrFunction* fn = os.depth > 0 ? &os.functions[os.depth - 1] : nullptr;
+        Assert(fn != nullptr || c.type == AsmChunk::Type::FunctionDefinition, "Error in optimizer: Chunk outside of function.");
+
+        switch (c.type)
+        {
+            case AsmChunk::Type::FunctionDefinition:
+            {
+                if (os.depth == os.functions.num)
+                {
+                    IrFunction* nfn = os.functions.push_init();
+                    nfn->instructions = dynamic_array_create<IrInstruction>(&ta);
+                }
+
+                fn = &os.functions[os.depth++];
+                fn->function_definition_index = c.index;
+                fn->instructions.num = 0;
+            } break;
+            case AsmChunk::Type::ScopeEnd:
+                end_function(&os);
+                break;
+            case AsmChunk::Type::VariableDeclaration:
+            {
+                const AsmChunkVariableDeclarationData& vd = gc->variable_declarations[c.index];
+
+                if (vd.has_initial_value)
+                    build_statement(&os, fn, IrInstruction::Op::Store, vd.local_variable_index, true, vd.initial_value);
+            } break;
+            case AsmChunk::Type::VariableAssignment:
+            {
+                const AsmChunkVariableAssignmentData& va = gc->variable_assignments[c.index];
+                build_statement(&os, fn, IrInstruction::Op::Store, va.local_variable_index, false, va.value);
+            } break;
+            case AsmChunk::Type::Return:
+                build_statement(&os, fn, IrInstruction::Op::Return, 0, false, gc->returns[c.index].value);
+                break;
+            default:
+                Error("Error in optimizer: Unknown chunk type.");
+                break;
+        }
+    }
+
+    Assert(os.depth == 0, "Error in optimizer: Function without ScopeEnd chunk.");
+    generated_code_destroy(gc);
+    *gc = out;
+}
+
+OptimizerOptions optimizer_options_all()
+{
+    OptimizerOptions o = {};
+    o.constant_propagation = true;
+    o.copy_propagation = true;
+    o.dead_store_elimination = true;
+    o.dead_code_elimination = true;
+    return o;
+}
+
+bool optimizer_options_any(const OptimizerOptions& options)
+{
+    return options.constant_propagation || options.copy_propagation || options.dead_store_elimination || options.dead_code_elimination;
+}
+
+void optimizer_stats_add(OptimizerStats* to, const OptimizerStats& from)
+{
+    to->constant_propagation_removed += from.constant_propagation_removed;
+    to->constant_propagation_loads += from.constant_propagation_loads;
+    to->copy_propagation_loads += from.copy_propagation_loads;
+    to->dead_store_elimination_removed += from.dead_store_elimination_removed;
+    to->dead_code_elimination_removed += from.dead_code_elimination_removed;
+}
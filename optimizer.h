@@ -0,0 +1,33 @@
+#pragma once
+#include <stdint.h>
+
+struct Allocator;
+struct GeneratedCode;
+struct GeneratorOptions;
+
+struct OptimizerOptions
+{
+    bool constant_propagation;
+    bool copy_propagation;
+    bool dead_store_elimination;
+    bool dead_code_elimination;
+};
+
+// How much each pass did, summed over all optimized functions.
+struct OptimizerStats
+{
+    uint64_t constant_propagation_removed; // Instructions folded away.
+    uint64_t constant_propagation_loads; // Loads replaced by the constant that was stored.
+    uint64_t copy_propagation_loads; // Loads replaced by a load of the variable that was copied.
+    uint64_t dead_store_elimination_removed; // Stores that nothing reads.
+    uint64_t dead_code_elimination_removed; // Unused or unreachable instructions.
+};
+
+OptimizerOptions optimizer_options_all();
+bool optimizer_options_any(const OptimizerOptions& options);
+void optimizer_stats_add(OptimizerStats* to, const OptimizerStats& from);
+
+// Turns each function in gc into an SSA IR, runs the enabled passes on it and lowers it back to
+// chunks, replacing the contents of gc. The locals of every function get their storage again from
+// the new live ranges, as the generator options ask for.
+void optimize(GeneratedCode* gc, const OptimizerOptions& options, const GeneratorOptions& generator, OptimizerStats* stats);
@@ -3,83 +3,179 @@
 #include <stdlib.h>
 #include "memory.h"
 #include "tokenizer.h"
+#include "symbol_table.h"
+#include "threading.h"
 
+// A scope that has been started but not ended. Its range is written to the payload of its owner
+// once it ends. Scopes are parsed with an explicit stack of these instead of recursion, so
+// nesting depth is only limited by memory.
+struct OpenScope
+{
+    unsigned scratch_start;
+    bool close_on_statement_end;
+    bool has_owner;
+    ParseNode::Type owner_type;
+    uint32_t owner_index;
+};
+
+// Tokens are read either from a fully tokenized TokenizerResult or, while the tokenizer is still
+// running, from a TokenRing. Token i is at index i & mask, where mask is all ones for the former.
+// end is how many tokens are known to be available.
 struct ParserState
 {
-    const Token* start;
-    const Token* head;
-    const Token* end;
-    Allocator* allocator;
+    const Token::Type* types;
+    const TokenSpan* spans;
+    const uint64_t* span_bases;
+    const uint32_t* symbols;
+    char* source;
+    size_t head;
+    size_t end;
+    size_t mask;
+    TokenRing* ring;
+    Ast* ast;
+
+    // Nodes of the scopes that are being parsed. A scope's nodes are moved into the pool when
+    // the scope ends, which makes them contiguous.
+    DynamicArray<ParseNode> scratch;
+    DynamicArray<OpenScope> open_scopes;
 };
 
+// Gives back the slots before head to the tokenizer and waits until at least num tokens from
+// head on are available, or the tokenizer is done.
+static void wait_for_tokens(ParserState* ps, size_t num)
+{
+    TokenRing* ring = ps->ring;
+    ring->consumed.store(ps->head, std::memory_order_release);
+
+    while (ps->end < ps->head + num)
+    {
+        const bool finished = ring->finished.load(std::memory_order_acquire);
+        ps->end = ring->written.load(std::memory_order_acquire);
+
+        if (finished)
+            return;
+
+        if (ps->end >= ps->head + num)
+            return;
+
+        if (ring->inline_producer)
+            token_ring_produce(ring);
+        else
+            thread_yield();
+    }
+}
+
+static size_t token_index(ParserState* ps, size_t ahead = 0)
+{
+    if (ps->head + ahead >= ps->end && ps->ring != nullptr)
+        wait_for_tokens(ps, ahead + 1);
+
+    return (ps->head + ahead) & ps->mask;
+}
+
+static Token::Type peek_type(ParserState* ps, size_t ahead = 0)
+{
+    return ps->types[token_index(ps, ahead)];
+}
+
+static char* head_val(ParserState* ps)
+{
+    const size_t i = token_index(ps);
+    return ps->source + token_position(ps->span_bases[i >> TokenSpanBlockBits], ps->spans[i].offset);
+}
+
+static unsigned head_len(ParserState* ps)
+{
+    return ps->spans[token_index(ps)].len;
+}
+
+static uint32_t head_symbol(ParserState* ps)
+{
+    return ps->symbols[token_index(ps)];
+}
+
+static bool has_tokens(ParserState* ps, size_t num)
+{
+    if (ps->head + num > ps->end && ps->ring != nullptr)
+        wait_for_tokens(ps, num);
+
+    return ps->end - ps->head >= num;
+}
+
 static DataType parse_type_name(ParserState* ps)
 {
-    Assert(ps->head->type == Token::Type::Name, "Error in parser: Tried to parse invalid type name.");
-    if (str_equal(ps->head->val, "i32", ps->head->len))
+    Assert(peek_type(ps) == Token::Type::TypeName, "Error in parser: Tried to parse invalid type name.");
+    if (head_symbol(ps) == SymbolI32)
     {
         ++ps->head;
         return DataType::Int32;
     }
 
-    Error("Error in parser: Unknown datatype.");
+    Error("Error in parser: Unsupported datatype.");
     return (DataType)(-1);
 }
 
-static size_t num_tokens_diff(const Token* s, const Token* e)
+static bool parse_func_def_check(ParserState* ps)
 {
-    return mem_ptr_diff(s, e) / sizeof(Token);
+    return has_tokens(ps, 2)
+        && peek_type(ps) == Token::Type::TypeName
+        && peek_type(ps, 1) == Token::Type::Name
+        && peek_type(ps, 2) == Token::Type::ArgStart;
 }
 
-static bool parse_func_def_check(ParserState* ps)
+static void push_node(ParserState* ps, ParseNode::Type type, uint32_t index)
 {
-    return num_tokens_diff(ps->head, ps->end) >= 2
-        && ps->head->type == Token::Type::Name
-        && (ps->head + 1)->type == Token::Type::Name
-        && (ps->head + 2)->type == Token::Type::ArgStart;
+    ParseNode* n = ps->scratch.push();
+    n->type = type;
+    n->index = index;
 }
 
-static void parse_scope(ParserState* ps, ParseScope* scope, bool close_on_statement_end = true);
+static void open_scope(ParserState* ps, bool close_on_statement_end, ParseNode::Type owner_type, uint32_t owner_index)
+{
+    OpenScope* os = ps->open_scopes.push();
+    os->scratch_start = ps->scratch.num;
+    os->close_on_statement_end = close_on_statement_end;
+    os->has_owner = true;
+    os->owner_type = owner_type;
+    os->owner_index = owner_index;
+}
 
-static void parse_func_def(ParserState* ps, ParseScope* scope)
+static void parse_func_def(ParserState* ps)
 {
     Assert(parse_func_def_check(ps), "Error in parser: Invalid func def.");
-    ParseNode* n = scope->nodes.push_init();
-    n->type = ParseNode::Type::FunctionDefinition;
-    ParseFunctionDefinition& pfd = n->function_definition;
-    pfd.return_type = parse_type_name(ps);
-    pfd.name = ps->head->val;
-    pfd.name_len = ps->head->len;
+    const uint32_t fdi = ps->ast->function_definitions.num;
+    push_node(ps, ParseNode::Type::FunctionDefinition, fdi);
+    ParseFunctionDefinition* pfd = ps->ast->function_definitions.push_init();
+    pfd->return_type = parse_type_name(ps);
+    pfd->name_symbol = head_symbol(ps);
     ++ps->head; // name
     ++ps->head; // arg start
     // TODO: READ ARGS
     ++ps->head; // arg end
-    pfd.scope.nodes = dynamic_array_create<ParseNode>(ps->allocator);
-    parse_scope(ps, &pfd.scope, false);
+    open_scope(ps, false, ParseNode::Type::FunctionDefinition, fdi);
 }
 
 static Value parse_value(ParserState* ps)
 {
-    const Token& t = *ps->head;
     Value v = {};
     v.type = DataType::Int32;
-    v.int32_literal_val = atoi(t.val);
-    v.str_val = t.val;
-    v.str_val_len = t.len;
+    v.int32_literal_val = atoi(head_val(ps));
+    v.str_val = head_val(ps);
+    v.str_val_len = head_len(ps);
     ++ps->head;
     return v;
 }
 
-static void parse_func_call_parameters(ParserState* ps, DynamicArray<Value>* parameters)
+static void parse_func_call_parameters(ParserState* ps)
 {
-    while (ps->head < ps->end)
+    while (has_tokens(ps, 1))
     {
-        const Token& t = *ps->head;
-        const Token* t_ptr = ps->head;
+        const size_t start_head = ps->head;
 
-        switch (t.type)
+        switch (peek_type(ps))
         {
             case Token::Type::Literal:
-                    parameters->add(parse_value(ps));
+                    ps->ast->values.add(parse_value(ps));
                 break;
             case Token::Type::ArgStart:
                 ++ps->head;
@@ -92,128 +188,238 @@ static void parse_func_call_parameters(ParserState* ps, DynamicArray<Value>* par
                 return;
         }
 
-        Assert(ps->head > t_ptr, "Parser error: Func call parameters parser stuck.");
+        Assert(ps->head > start_head, "Parser error: Func call parameters parser stuck.");
     }
 }
 
 static bool parse_func_call_check(ParserState* ps)
 {
-    return num_tokens_diff(ps->head, ps->end) >= 2
-        && ps->head->type == Token::Type::Name
-        && (ps->head + 1)->type == Token::Type::ArgStart;
+    return has_tokens(ps, 2)
+        && peek_type(ps) == Token::Type::Name
+        && peek_type(ps, 1) == Token::Type::ArgStart;
 }
 
-static void parse_func_call(ParserState* ps, ParseScope* scope)
+static void parse_func_call(ParserState* ps)
 {
     Assert(parse_func_call_check(ps), "Error in parser: Invalid func call.");
-    ParseNode* n = scope->nodes.push_init();
-    n->type = ParseNode::Type::FunctionCall;
-    ParseFunctionCall& pfc = n->function_call;
-    pfc.name = ps->head->val;
-    pfc.name_len = ps->head->len;
+    push_node(ps, ParseNode::Type::FunctionCall, ps->ast->function_calls.num);
+    ParseFunctionCall* pfc = ps->ast->function_calls.push_init();
+    pfc->name_symbol = head_symbol(ps);
     ++ps->head;
-    pfc.parameters = dynamic_array_create<Value>(ps->allocator);
-    parse_func_call_parameters(ps, &pfc.parameters);
+    pfc->first_parameter = ps->ast->values.num;
+    parse_func_call_parameters(ps);
+    pfc->num_parameters = ps->ast->values.num - pfc->first_parameter;
 }
 
-#define parse_loop_check (num_tokens_diff(ps->head, ps->end) >= 1 \
-        && ps->head->type == Token::Type::Name \
-        && memcmp(ps->head->val, "loop", ps->head->len) == 0)
-
-static void parse_loop(ParserState* ps, ParseScope* scope)
+static void parse_loop(ParserState* ps)
 {
-    Assert(parse_loop_check, "Error in parser: Invalid loop.");
-    ParseNode* n = scope->nodes.push_init();
-    n->type = ParseNode::Type::Loop;
-    ParseLoop& pl = n->loop;
+    Assert(peek_type(ps) == Token::Type::KwLoop, "Error in parser: Invalid loop.");
+    const uint32_t li = ps->ast->loops.num;
+    push_node(ps, ParseNode::Type::Loop, li);
+    ps->ast->loops.push_init();
     ++ps->head; // loop keyword
     ++ps->head; // opening brace! TODO: fix no-brace type
-    pl.scope.nodes = dynamic_array_create<ParseNode>(ps->allocator);
-    parse_scope(ps, &pl.scope);
+    open_scope(ps, true, ParseNode::Type::Loop, li);
 }
 
+static const unsigned PrefixBindingPower = 30;
 
-static ParseExpression parse_expression(ParserState* ps)
+// Zero for tokens that don't continue an expression.
+static unsigned infix_binding_power(ParserState* ps, ParseExpressionNode::Type* type)
 {
-    ParseExpression expr = {};
-    expr.operand1 = parse_value(ps);
+    if (!has_tokens(ps, 1) || peek_type(ps) != Token::Type::Operator)
+        return 0;
 
-    // get statement end, remove later..
-    ++ps->head;
-    
-    // TODO ADD STUFF HERE
-    //if (ps->head->type == ParseNode::Type::StatementEnd)
-        return expr;
+    switch (head_val(ps)[0])
+    {
+        case '+': *type = ParseExpressionNode::Type::Add; return 10;
+        case '-': *type = ParseExpressionNode::Type::Subtract; return 10;
+        case '*': *type = ParseExpressionNode::Type::Multiply; return 20;
+        case '/': *type = ParseExpressionNode::Type::Divide; return 20;
+    }
+
+    Error("Error in parser: Unknown operator.");
+    return 0;
+}
+
+static bool fold_binary(ParseExpressionNode::Type type, int32_t lhs, int32_t rhs, int32_t* result)
+{
+    // Wraps like the 32 bit instructions that would otherwise be generated. Divisions that would
+    // fault are left to do so.
+    switch (type)
+    {
+        case ParseExpressionNode::Type::Add: *result = (int32_t)((uint32_t)lhs + (uint32_t)rhs); return true;
+        case ParseExpressionNode::Type::Subtract: *result = (int32_t)((uint32_t)lhs - (uint32_t)rhs); return true;
+        case ParseExpressionNode::Type::Multiply: *result = (int32_t)((uint32_t)lhs * (uint32_t)rhs); return true;
+        case ParseExpressionNode::Type::Divide:
+            if (rhs == 0 || (lhs == INT32_MIN && rhs == -1))
+                return false;
+
+            *result = lhs / rhs;
+            return true;
+    }
+
+    Error("Error in parser: Tried to fold unknown operator.");
+    return false;
+}
+
+// In postfix order a subexpression that ends in a literal is that literal, so if the last two
+// nodes are literals they are exactly the operands of the binary operator that follows them.
+static void push_binary_expression_node(ParserState* ps, ParseExpressionNode::Type type)
+{
+    DynamicArray<ParseExpressionNode>& nodes = ps->ast->expression_nodes;
+    const unsigned n = nodes.num;
+
+    if (n >= 2 && nodes[n - 2].type == ParseExpressionNode::Type::Literal && nodes[n - 1].type == ParseExpressionNode::Type::Literal
+        && fold_binary(type, nodes[n - 2].literal, nodes[n - 1].literal, &nodes[n - 2].literal))
+    {
+        --nodes.num;
+        return;
+    }
+
+    ParseExpressionNode* node = nodes.push_init();
+    node->type = type;
+}
+
+static void parse_expression_with_binding_power(ParserState* ps, unsigned min_binding_power);
+
+static void parse_expression_prefix(ParserState* ps)
+{
+    DynamicArray<ParseExpressionNode>& nodes = ps->ast->expression_nodes;
+
+    switch (peek_type(ps))
+    {
+        case Token::Type::Literal:
+        {
+            ParseExpressionNode* node = nodes.push_init();
+            node->type = ParseExpressionNode::Type::Literal;
+            node->literal = atoi(head_val(ps));
+            ++ps->head;
+        } break;
+        case Token::Type::Name:
+        {
+            ParseExpressionNode* node = nodes.push_init();
+            node->type = ParseExpressionNode::Type::Variable;
+            node->name_symbol = head_symbol(ps);
+            ++ps->head;
+        } break;
+        case Token::Type::ArgStart:
+        {
+            ++ps->head;
+            parse_expression_with_binding_power(ps, 0);
+            Assert(peek_type(ps) == Token::Type::ArgEnd, "Error in parser: Missing closing parenthesis in expression.");
+            ++ps->head;
+        } break;
+        case Token::Type::Operator:
+        {
+            Assert(head_val(ps)[0] == '-', "Error in parser: Unknown prefix operator.");
+            ++ps->head;
+            parse_expression_with_binding_power(ps, PrefixBindingPower);
 
+            if (nodes.last().type == ParseExpressionNode::Type::Literal)
+            {
+                nodes.last().literal = (int32_t)(0u - (uint32_t)nodes.last().literal);
+            }
+            else
+            {
+                ParseExpressionNode* node = nodes.push_init();
+                node->type = ParseExpressionNode::Type::Negate;
+            }
+        } break;
+        default:
+            Error("Error in parser: Expected expression.");
+            break;
+    }
+}
+
+// Pratt parser. Operators that bind tighter than min_binding_power are parsed as part of this
+// subexpression, the rest are left to the caller. Equal powers stop the loop, which makes
+// operators left associative.
+static void parse_expression_with_binding_power(ParserState* ps, unsigned min_binding_power)
+{
+    parse_expression_prefix(ps);
+
+    while (true)
+    {
+        ParseExpressionNode::Type type;
+        const unsigned binding_power = infix_binding_power(ps, &type);
 
+        if (binding_power <= min_binding_power)
+            return;
+
+        ++ps->head;
+        parse_expression_with_binding_power(ps, binding_power);
+        push_binary_expression_node(ps, type);
+    }
+}
+
+static ParseExpression parse_expression(ParserState* ps)
+{
+    ParseExpression expr = {};
+    expr.first = ps->ast->expression_nodes.num;
+    parse_expression_with_binding_power(ps, 0);
+    expr.num = ps->ast->expression_nodes.num - expr.first;
+    return expr;
 }
 
 static bool parse_variable_decl_check(ParserState* ps)
 {
-    return num_tokens_diff(ps->head, ps->end) >= 3
-        && ps->head->type == Token::Type::Name
-        && (memcmp(ps->head->val, "let", ps->head->len) == 0 || memcmp(ps->head->val, "mut", ps->head->len) == 0)
-        && (ps->head + 1)->type == Token::Type::Name;
+    return has_tokens(ps, 3)
+        && (peek_type(ps) == Token::Type::KwLet || peek_type(ps) == Token::Type::KwMut)
+        && peek_type(ps, 1) == Token::Type::Name;
 }
 
-static void parse_variable_decl(ParserState* ps, ParseScope* scope)
+static void parse_variable_decl(ParserState* ps)
 {
     Assert(parse_variable_decl_check(ps), "Error in parser: Invalid variable decl.");
-    ParseNode* n = scope->nodes.push_init();
-    n->type = ParseNode::Type::VariableDeclaration;
-    ParseVariableDeclaration& vd = n->variable_declaration;
-    vd.is_mutable = memcmp(ps->head->val, "mut", ps->head->len) == 0;
-    vd.has_initial_value = true;
+    push_node(ps, ParseNode::Type::VariableDeclaration, ps->ast->variable_declarations.num);
+    ParseVariableDeclaration* vd = ps->ast->variable_declarations.push_init();
+    vd->is_mutable = peek_type(ps) == Token::Type::KwMut;
+    vd->has_initial_value = true;
     ++ps->head; // let/mut
-    vd.name = ps->head->val;
-    vd.name_len = ps->head->len;
+    vd->name_symbol = head_symbol(ps);
     ++ps->head; // name
     ++ps->head; // assignment op
-    vd.value_expr = parse_expression(ps);
-    vd.type = vd.value_expr.operand1.type;
+    vd->value_expr = parse_expression(ps);
+    vd->type = DataType::Int32;
 }
 
 static bool is_variable_assignment(ParserState* ps)
 {
-    return num_tokens_diff(ps->head, ps->end) >= 2
-        && ps->head->type == Token::Type::Name
-        && (ps->head + 1)->type == Token::Type::Assignment;
+    return has_tokens(ps, 2)
+        && peek_type(ps) == Token::Type::Name
+        && peek_type(ps, 1) == Token::Type::Assignment;
 }
 
-static void parse_variable_assignment(ParserState* ps, ParseScope* scope)
+static void parse_variable_assignment(ParserState* ps)
 {
     Assert(is_variable_assignment(ps), "Error in parser: Invalid variable assignment.");
-    ParseNode* n = scope->nodes.push_init();
-    n->type = ParseNode::Type::VariableAssignment;
-    ParseVariableAssignment& va = n->variable_assignment;
-    va.name = ps->head->val;
-    va.name_len = ps->head->len;
+    push_node(ps, ParseNode::Type::VariableAssignment, ps->ast->variable_assignments.num);
+    ParseVariableAssignment* va = ps->ast->variable_assignments.push_init();
+    va->name_symbol = head_symbol(ps);
     ++ps->head; // name done
     ++ps->head; // get rid of assignment op
-    va.value_expr = parse_expression(ps);
+    va->value_expr = parse_expression(ps);
 }
 
-static void parse_name_in_scope(ParserState* ps, ParseScope* scope)
+static void parse_return(ParserState* ps)
 {
-    if (parse_func_def_check(ps))
-    {
-        parse_func_def(ps, scope);
-    }
-    else if (parse_func_call_check(ps))
-    {
-        parse_func_call(ps, scope);
-    }
-    else if (parse_loop_check)
-    {
-        parse_loop(ps, scope);
-    }
-    else if (parse_variable_decl_check(ps))
+    Assert(peek_type(ps) == Token::Type::KwRet, "Error in parser: Invalid return.");
+    push_node(ps, ParseNode::Type::Return, ps->ast->returns.num);
+    ParseReturn* pr = ps->ast->returns.push_init();
+    ++ps->head; // ret
+    pr->value = parse_expression(ps);
+}
+
+static void parse_name_in_scope(ParserState* ps)
+{
+    if (parse_func_call_check(ps))
     {
-        parse_variable_decl(ps, scope);
+        parse_func_call(ps);
     }
     else if (is_variable_assignment(ps))
     {
-        parse_variable_assignment(ps, scope);
+        parse_variable_assignment(ps);
     }
     else
     {
@@ -221,50 +427,567 @@ static void parse_name_in_scope(ParserState* ps, ParseScope* scope)
     }
 }
 
-static void parse_scope(ParserState* ps, ParseScope* scope, bool close_on_statement_end)
+// Parses nodes into the innermost open scope. Returns true when that scope has ended and false when
+// a nested scope was opened.
+static bool parse_open_scope(ParserState* ps)
 {
-    while (ps->start < ps->end)
+    OpenScope* os = &ps->open_scopes.last();
+
+    while (has_tokens(ps, 1))
     {
-        const Token& t = *ps->head;
-        const Token* t_ptr = ps->head;
+        const size_t start_head = ps->head;
 
-        switch (t.type)
+        switch (peek_type(ps))
         {
             case Token::Type::Name:
-                parse_name_in_scope(ps, scope);
+                parse_name_in_scope(ps);
+                break;
+            case Token::Type::TypeName:
+                parse_func_def(ps);
+                return false;
+            case Token::Type::KwLoop:
+                parse_loop(ps);
+                return false;
+            case Token::Type::KwLet:
+            case Token::Type::KwMut:
+                parse_variable_decl(ps);
+                break;
+            case Token::Type::KwRet:
+                parse_return(ps);
                 break;
             case Token::Type::StatementEnd:
                 ++ps->head;
-                if (close_on_statement_end)
-                    return;
+                if (os->close_on_statement_end)
+                    return true;
                 else
                     break;
             case Token::Type::ScopeStart:
                 ++ps->head;
-                close_on_statement_end = false;
+                os->close_on_statement_end = false;
                 break;
             case Token::Type::ScopeEnd:
-                Assert(close_on_statement_end == false, "Error in parser: Scope start end mismatch.");
+                Assert(os->close_on_statement_end == false, "Error in parser: Scope start end mismatch.");
                 ++ps->head;
-                return;
+                return true;
             case Token::Type::EndOfFile:
-                Assert(close_on_statement_end == false, "Error in parser: Scope start end mismatch.");
-                return;
+                Assert(os->close_on_statement_end == false, "Error in parser: Scope start end mismatch.");
+                return true;
         }
 
-        Assert(ps->head > t_ptr, "Parser stuck.");
+        Assert(ps->head > start_head, "Parser stuck.");
     }
+
+    return true;
 }
 
-ParseScope parse(Allocator* alloc, const Token* lex_tokens, size_t num_lex_tokens)
+// Moves the nodes of the innermost open scope into the pool and hands its range to the owner.
+static ParseScope close_scope(ParserState* ps)
+{
+    const OpenScope os = ps->open_scopes.last();
+    --ps->open_scopes.num;
+    ParseScope scope = {};
+    scope.first = ps->ast->nodes.num;
+    scope.num = ps->scratch.num - os.scratch_start;
+
+    for (unsigned i = os.scratch_start; i < ps->scratch.num; ++i)
+        ps->ast->nodes.add(ps->scratch[i]);
+
+    ps->scratch.num = os.scratch_start;
+
+    if (!os.has_owner)
+        return scope;
+
+    switch (os.owner_type)
+    {
+        case ParseNode::Type::FunctionDefinition:
+            ps->ast->function_definitions[os.owner_index].scope = scope;
+            break;
+        case ParseNode::Type::Loop:
+            ps->ast->loops[os.owner_index].scope = scope;
+            break;
+        default:
+            Error("Error in parser: Invalid scope owner.");
+            break;
+    }
+
+    return scope;
+}
+
+static ParseScope parse_scope(ParserState* ps, bool close_on_statement_end)
+{
+    const unsigned base = ps->open_scopes.num;
+    OpenScope* os = ps->open_scopes.push_init();
+    os->scratch_start = ps->scratch.num;
+    os->close_on_statement_end = close_on_statement_end;
+    ParseScope scope = {};
+
+    while (ps->open_scopes.num > base)
+    {
+        if (parse_open_scope(ps))
+            scope = close_scope(ps);
+    }
+
+    return scope;
+}
+
+static void ast_init(Ast* ast, Allocator* alloc)
+{
+    memset(ast, 0, sizeof(Ast));
+    ast->nodes = dynamic_array_create<ParseNode>(alloc);
+    ast->scopes = dynamic_array_create<ParseScope>(alloc);
+    ast->function_definitions = dynamic_array_create<ParseFunctionDefinition>(alloc);
+    ast->function_calls = dynamic_array_create<ParseFunctionCall>(alloc);
+    ast->loops = dynamic_array_create<ParseLoop>(alloc);
+    ast->variable_declarations = dynamic_array_create<ParseVariableDeclaration>(alloc);
+    ast->variable_assignments = dynamic_array_create<ParseVariableAssignment>(alloc);
+    ast->returns = dynamic_array_create<ParseReturn>(alloc);
+    ast->values = dynamic_array_create<Value>(alloc);
+    ast->expression_nodes = dynamic_array_create<ParseExpressionNode>(alloc);
+}
+
+void ast_destroy(Ast* ast)
+{
+    dynamic_array_destroy(&ast->expression_nodes);
+    dynamic_array_destroy(&ast->values);
+    dynamic_array_destroy(&ast->returns);
+    dynamic_array_destroy(&ast->variable_assignments);
+    dynamic_array_destroy(&ast->variable_declarations);
+    dynamic_array_destroy(&ast->loops);
+    dynamic_array_destroy(&ast->function_calls);
+    dynamic_array_destroy(&ast->function_definitions);
+    dynamic_array_destroy(&ast->scopes);
+    dynamic_array_destroy(&ast->nodes);
+}
+
+// The tables grow while parsing, so they are built in a heap allocator, where the old buffers
+// are freed, and merged into the final allocator with their exact sizes afterwards.
+static void parse_root_scope(ParserState* ps, Ast* building, Allocator* heap)
+{
+    ast_init(building, heap);
+    ps->ast = building;
+    ps->scratch = dynamic_array_create<ParseNode>(heap);
+    ps->open_scopes = dynamic_array_create<OpenScope>(heap);
+    building->root = parse_scope(ps, false);
+    dynamic_array_destroy(&ps->open_scopes);
+    dynamic_array_destroy(&ps->scratch);
+}
+
+template<typename T>
+static DynamicArray<T> create_table(Allocator* alloc, unsigned num)
+{
+    DynamicArray<T> da = dynamic_array_create<T>(alloc);
+    da.data = (T*)alloc->alloc(sizeof(T) * num);
+    da.num = num;
+    da.capacity = num;
+    return da;
+}
+
+template<typename T>
+static void copy_table(DynamicArray<T>* dest, unsigned dest_first, const DynamicArray<T>& src)
+{
+    memcpy(dest->data + dest_first, src.data, sizeof(T) * src.num);
+}
+
+static const unsigned NumParseNodeTypes = (unsigned)ParseNode::Type::Return + 1;
+
+// Concatenates the ASTs of consecutive ranges of the token stream. The root nodes of all parts are
+// placed last, in order, so they form one contiguous root scope. Everything else keeps its order
+// within its part and only has its indices moved by where the part's tables ended up.
+static Ast merge_asts(Allocator* alloc, const Ast* parts, unsigned num_parts)
+{
+    unsigned num_nodes = 0, num_scopes = 0, num_function_definitions = 0, num_function_calls = 0, num_loops = 0;
+    unsigned num_variable_declarations = 0, num_variable_assignments = 0, num_returns = 0, num_values = 0, num_expression_nodes = 0, num_root_nodes = 0;
+
+    for (unsigned i = 0; i < num_parts; ++i)
+    {
+        const Ast& p = parts[i];
+        Assert(p.root.first + p.root.num == p.nodes.num, "Error in parser: Root scope must be last in the node pool.");
+        num_nodes += p.nodes.num;
+        num_scopes += p.scopes.num;
+        num_function_definitions += p.function_definitions.num;
+        num_function_calls += p.function_calls.num;
+        num_loops += p.loops.num;
+        num_variable_declarations += p.variable_declarations.num;
+        num_variable_assignments += p.variable_assignments.num;
+        num_returns += p.returns.num;
+        num_values += p.values.num;
+        num_expression_nodes += p.expression_nodes.num;
+        num_root_nodes += p.root.num;
+    }
+
+    Ast ast = {};
+    ast.nodes = create_table<ParseNode>(alloc, num_nodes);
+    ast.scopes = create_table<ParseScope>(alloc, num_scopes);
+    ast.function_definitions = create_table<ParseFunctionDefinition>(alloc, num_function_definitions);
+    ast.function_calls = create_table<ParseFunctionCall>(alloc, num_function_calls);
+    ast.loops = create_table<ParseLoop>(alloc, num_loops);
+    ast.variable_declarations = create_table<ParseVariableDeclaration>(alloc, num_variable_declarations);
+    ast.variable_assignments = create_table<ParseVariableAssignment>(alloc, num_variable_assignments);
+    ast.returns = create_table<ParseReturn>(alloc, num_returns);
+    ast.values = create_table<Value>(alloc, num_values);
+    ast.expression_nodes = create_table<ParseExpressionNode>(alloc, num_expression_nodes);
+    ast.root.first = num_nodes - num_root_nodes;
+    ast.root.num = num_root_nodes;
+
+    unsigned node_offset = 0;
+    unsigned root_offset = ast.root.first;
+    unsigned value_offset = 0;
+    unsigned expression_offset = 0;
+    unsigned type_offsets[NumParseNodeTypes] = {};
+
+    for (unsigned i = 0; i < num_parts; ++i)
+    {
+        const Ast& p = parts[i];
+
+        for (unsigned n = 0; n < p.nodes.num; ++n)
+        {
+            ParseNode node = p.nodes[n];
+            node.index += type_offsets[(unsigned)node.type];
+            ast.nodes[n < p.root.first ? node_offset + n : root_offset + n - p.root.first] = node;
+        }
+
+        for (unsigned s = 0; s < p.scopes.num; ++s)
+        {
+            ParseScope scope = p.scopes[s];
+            scope.first += node_offset;
+            ast.scopes[type_offsets[(unsigned)ParseNode::Type::Scope] + s] = scope;
+        }
+
+        for (unsigned f = 0; f < p.function_definitions.num; ++f)
+        {
+            ParseFunctionDefinition fd = p.function_definitions[f];
+            fd.scope.first += node_offset;
+            ast.function_definitions[type_offsets[(unsigned)ParseNode::Type::FunctionDefinition] + f] = fd;
+        }
+
+        for (unsigned c = 0; c < p.function_calls.num; ++c)
+        {
+            ParseFunctionCall fc = p.function_calls[c];
+            fc.first_parameter += value_offset;
+            ast.function_calls[type_offsets[(unsigned)ParseNode::Type::FunctionCall] + c] = fc;
+        }
+
+        for (unsigned l = 0; l < p.loops.num; ++l)
+        {
+            ParseLoop loop = p.loops[l];
+            loop.scope.first += node_offset;
+            ast.loops[type_offsets[(unsigned)ParseNode::Type::Loop] + l] = loop;
+        }
+
+        for (unsigned d = 0; d < p.variable_declarations.num; ++d)
+        {
+            ParseVariableDeclaration vd = p.variable_declarations[d];
+            vd.value_expr.first += expression_offset;
+            ast.variable_declarations[type_offsets[(unsigned)ParseNode::Type::VariableDeclaration] + d] = vd;
+        }
+
+        for (unsigned a = 0; a < p.variable_assignments.num; ++a)
+        {
+            ParseVariableAssignment va = p.variable_assignments[a];
+            va.value_expr.first += expression_offset;
+            ast.variable_assignments[type_offsets[(unsigned)ParseNode::Type::VariableAssignment] + a] = va;
+        }
+
+        for (unsigned r = 0; r < p.returns.num; ++r)
+        {
+            ParseReturn ret = p.returns[r];
+            ret.value.first += expression_offset;
+            ast.returns[type_offsets[(unsigned)ParseNode::Type::Return] + r] = ret;
+        }
+
+        copy_table(&ast.values, value_offset, p.values);
+        copy_table(&ast.expression_nodes, expression_offset, p.expression_nodes);
+
+        node_offset += p.root.first;
+        root_offset += p.root.num;
+        value_offset += p.values.num;
+        expression_offset += p.expression_nodes.num;
+        type_offsets[(unsigned)ParseNode::Type::Scope] += p.scopes.num;
+        type_offsets[(unsigned)ParseNode::Type::FunctionDefinition] += p.function_definitions.num;
+        type_offsets[(unsigned)ParseNode::Type::FunctionCall] += p.function_calls.num;
+        type_offsets[(unsigned)ParseNode::Type::Loop] += p.loops.num;
+        type_offsets[(unsigned)ParseNode::Type::VariableDeclaration] += p.variable_declarations.num;
+        type_offsets[(unsigned)ParseNode::Type::VariableAssignment] += p.variable_assignments.num;
+        type_offsets[(unsigned)ParseNode::Type::Return] += p.returns.num;
+    }
+
+    return ast;
+}
+
+static Ast parse_serial(ParserState* ps, Allocator* alloc)
+{
+    Allocator heap = create_heap_allocator();
+    Ast building;
+    parse_root_scope(ps, &building, &heap);
+    Ast ast = merge_asts(alloc, &building, 1);
+    ast_destroy(&building);
+    return ast;
+}
+
+// Top level definitions don't depend on each other, so large token streams are cut into ranges
+// that end right after a closing brace at depth zero, found with a quick scan over the token
+// types. Each range is parsed on its own thread into its own tables, which are then merged in
+// source order.
+static const size_t ParallelParseMinRangeTokens = 64 * 1024;
+static const unsigned MaxParserThreads = 16;
+
+struct ParseRangeJob
+{
+    ParserState ps;
+    Allocator heap;
+    Ast ast;
+    Thread thread;
+};
+
+static void parse_range_job(void* arg)
+{
+    ParseRangeJob* job = (ParseRangeJob*)arg;
+    parse_root_scope(&job->ps, &job->ast, &job->heap);
+}
+
+static unsigned num_parser_threads(size_t num_tokens)
+{
+    size_t n = thread_num_cpus();
+
+    if (n > MaxParserThreads)
+        n = MaxParserThreads;
+
+    if (n > num_tokens / ParallelParseMinRangeTokens)
+        n = num_tokens / ParallelParseMinRangeTokens;
+
+    return n < 1 ? 1 : (unsigned)n;
+}
+
+// Fills range_ends with up to max_ranges token indices that each end a range, the last one being
+// num. The cut for range i is the first top level closing brace at or after i / max_ranges of
+// the tokens.
+static unsigned find_top_level_ranges(const TokenizerResult& tokens, size_t* range_ends, unsigned max_ranges)
+{
+    unsigned num_ranges = 0;
+    size_t next_cut = tokens.num / max_ranges;
+    int depth = 0;
+
+    for (size_t i = 0; i < tokens.num && num_ranges < max_ranges - 1; ++i)
+    {
+        const Token::Type t = tokens.types[i];
+
+        if (t == Token::Type::ScopeStart)
+        {
+            ++depth;
+        }
+        else if (t == Token::Type::ScopeEnd)
+        {
+            --depth;
+
+            if (depth < 0)
+                return 0;
+
+            if (depth == 0 && i + 1 >= next_cut)
+            {
+                range_ends[num_ranges++] = i + 1;
+                next_cut = tokens.num / max_ranges * (num_ranges + 1);
+            }
+        }
+    }
+
+    range_ends[num_ranges++] = tokens.num;
+    return num_ranges;
+}
+
+#if defined(DEBUG)
+// These have padding, which isn't necessarily copied when the parts are merged, so they are
+// compared field by field.
+static bool values_equal(const DynamicArray<Value>& a, const DynamicArray<Value>& b)
+{
+    if (a.num != b.num)
+        return false;
+
+    for (unsigned i = 0; i < a.num; ++i)
+    {
+        const Value& x = a.data[i];
+        const Value& y = b.data[i];
+
+        if (x.type != y.type || x.str_val != y.str_val || x.str_val_len != y.str_val_len)
+            return false;
+    }
+
+    return true;
+}
+
+static bool variable_declarations_equal(const DynamicArray<ParseVariableDeclaration>& a, const DynamicArray<ParseVariableDeclaration>& b)
+{
+    if (a.num != b.num)
+        return false;
+
+    for (unsigned i = 0; i < a.num; ++i)
+    {
+        const ParseVariableDeclaration& x = a.data[i];
+        const ParseVariableDeclaration& y = b.data[i];
+
+        if (x.type != y.type || x.name_symbol != y.name_symbol || x.is_mutable != y.is_mutable || x.has_initial_value != y.has_initial_value
+            || x.value_expr.first != y.value_expr.first || x.value_expr.num != y.value_expr.num)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+#endif
+
+Ast parse(Allocator* alloc, const TokenizerResult& tokens)
+{
+    ParserState ps = {};
+    ps.types = tokens.types;
+    ps.spans = tokens.spans;
+    ps.span_bases = tokens.span_bases;
+    ps.symbols = tokens.symbols;
+    ps.source = tokens.source;
+    ps.end = tokens.num;
+    ps.mask = ~(size_t)0;
+
+    const unsigned num_threads = num_parser_threads(tokens.num);
+    size_t range_ends[MaxParserThreads];
+    const unsigned num_ranges = num_threads > 1 ? find_top_level_ranges(tokens, range_ends, num_threads) : 0;
+
+    if (num_ranges < 2)
+        return parse_serial(&ps, alloc);
+
+    ParseRangeJob jobs[MaxParserThreads] = {};
+    size_t range_start = 0;
+
+    for (unsigned i = 0; i < num_ranges; ++i)
+    {
+        ParseRangeJob& job = jobs[i];
+        job.heap = create_heap_allocator();
+        job.ps = ps;
+        job.ps.head = range_start;
+        job.ps.end = range_ends[i];
+        range_start = range_ends[i];
+        thread_start(&job.thread, parse_range_job, &job);
+    }
+
+    Ast parts[MaxParserThreads];
+
+    for (unsigned i = 0; i < num_ranges; ++i)
+    {
+        thread_join(&jobs[i].thread);
+        parts[i] = jobs[i].ast;
+    }
+
+    Ast ast = merge_asts(alloc, parts, num_ranges);
+
+    for (unsigned i = 0; i < num_ranges; ++i)
+        ast_destroy(&jobs[i].ast);
+
+    #if defined(DEBUG)
+        Allocator ta = create_temp_allocator();
+        Ast serial = parse_serial(&ps, &ta);
+        Assert(serial.nodes.num == ast.nodes.num
+            && serial.root.first == ast.root.first
+            && serial.root.num == ast.root.num
+            && serial.scopes.num == ast.scopes.num
+            && serial.function_definitions.num == ast.function_definitions.num
+            && serial.function_calls.num == ast.function_calls.num
+            && serial.loops.num == ast.loops.num
+            && serial.returns.num == ast.returns.num
+            && serial.variable_assignments.num == ast.variable_assignments.num
+            && serial.expression_nodes.num == ast.expression_nodes.num
+            && values_equal(serial.values, ast.values)
+            && variable_declarations_equal(serial.variable_declarations, ast.variable_declarations)
+            && memcmp(serial.nodes.data, ast.nodes.data, sizeof(ParseNode) * ast.nodes.num) == 0
+            && memcmp(serial.scopes.data, ast.scopes.data, sizeof(ParseScope) * ast.scopes.num) == 0
+            && memcmp(serial.function_definitions.data, ast.function_definitions.data, sizeof(ParseFunctionDefinition) * ast.function_definitions.num) == 0
+            && memcmp(serial.function_calls.data, ast.function_calls.data, sizeof(ParseFunctionCall) * ast.function_calls.num) == 0
+            && memcmp(serial.loops.data, ast.loops.data, sizeof(ParseLoop) * ast.loops.num) == 0
+            && memcmp(serial.returns.data, ast.returns.data, sizeof(ParseReturn) * ast.returns.num) == 0
+            && memcmp(serial.variable_assignments.data, ast.variable_assignments.data, sizeof(ParseVariableAssignment) * ast.variable_assignments.num) == 0
+            && memcmp(serial.expression_nodes.data, ast.expression_nodes.data, sizeof(ParseExpressionNode) * ast.expression_nodes.num) == 0,
+            "Error in parser: Parallel and serial parsing generated different result.");
+    #endif
+
+    return ast;
+}
+
+Ast parse_from_ring(Allocator* alloc, TokenRing* ring)
 {
     ParserState ps = {};
-    ps.start = lex_tokens;
-    ps.head = ps.start;
-    ps.end = ps.start + num_lex_tokens;
-    ps.allocator = alloc;
-    ParseScope root_scope = {};
-    root_scope.nodes = dynamic_array_create<ParseNode>(alloc);
-    parse_scope(&ps, &root_scope, false);
-    return root_scope;
-}
\ No newline at end of file
+    ps.types = ring->types;
+    ps.spans = ring->spans;
+    ps.span_bases = ring->span_bases;
+    ps.symbols = ring->symbols;
+    ps.source = ring->source;
+    ps.mask = ring->capacity - 1;
+    ps.ring = ring;
+    return parse_serial(&ps, alloc);
+}
+
+struct StreamingParser
+{
+    ParserState ps;
+    bool finished;
+};
+
+StreamingParser* streaming_parser_create(Allocator* alloc, TokenRing* ring)
+{
+    StreamingParser* sp = (StreamingParser*)alloc->alloc_zero(sizeof(StreamingParser));
+    ParserState& ps = sp->ps;
+    ps.types = ring->types;
+    ps.spans = ring->spans;
+    ps.span_bases = ring->span_bases;
+    ps.symbols = ring->symbols;
+    ps.source = ring->source;
+    ps.mask = ring->capacity - 1;
+    ps.ring = ring;
+    ps.scratch = dynamic_array_create<ParseNode>(alloc);
+    ps.open_scopes = dynamic_array_create<OpenScope>(alloc);
+    ps.open_scopes.push_init();
+    return sp;
+}
+
+void streaming_parser_destroy(Allocator* alloc, StreamingParser* sp)
+{
+    dynamic_array_destroy(&sp->ps.open_scopes);
+    dynamic_array_destroy(&sp->ps.scratch);
+    alloc->dealloc(sp);
+}
+
+// The root scope stays open between calls. Whenever a scope owned by a root node is closed, the
+// root nodes parsed since the last call, the last one being that owner, become the root of the
+// returned AST.
+bool streaming_parser_next(StreamingParser* sp, Allocator* alloc, Ast* ast)
+{
+    if (sp->finished)
+        return false;
+
+    ParserState* ps = &sp->ps;
+    ast_init(ast, alloc);
+    ps->ast = ast;
+
+    while (true)
+    {
+        if (!parse_open_scope(ps))
+            continue;
+
+        if (ps->open_scopes.num == 1)
+        {
+            sp->finished = true;
+            break;
+        }
+
+        close_scope(ps);
+
+        if (ps->open_scopes.num == 1)
+            break;
+    }
+
+    ast->root.first = ast->nodes.num;
+    ast->root.num = ps->scratch.num;
+
+    for (unsigned i = 0; i < ps->scratch.num; ++i)
+        ast->nodes.add(ps->scratch[i]);
+
+    ps->scratch.num = 0;
+    ps->ast = nullptr;
+    return ast->root.num > 0;
+}
@@ -1,10 +1,12 @@
 #pragma once
 #include <stdio.h>
+#include <stdint.h>
 #include "dynamic_array.h"
 #include "data_type.h"
 
 struct Allocator;
-struct Token;
+struct TokenizerResult;
+struct TokenRing;
 
 struct Value
 {
@@ -19,26 +21,28 @@ struct Value
     unsigned str_val_len;
 };
 
-struct ParseNode;
-
+// The AST is one flat pool of ParseNodes. The nodes of a scope are a contiguous range of the
+// pool and the payload of a node lives in the side table for its type, at index. Nodes are
+// 8 bytes so walking a scope reads memory linearly.
 struct ParseScope
 {
-    DynamicArray<ParseNode> nodes;
+    uint32_t first;
+    uint32_t num;
 };
 
 struct ParseFunctionDefinition
 {
     DataType return_type;
-    char* name;
-    unsigned name_len;
+    uint32_t name_symbol;
     ParseScope scope;
 };
 
+// parameters are a range in Ast::values.
 struct ParseFunctionCall
 {
-    char* name;
-    unsigned name_len;
-    DynamicArray<Value> parameters;
+    uint32_t name_symbol;
+    uint32_t first_parameter;
+    uint32_t num_parameters;
 };
 
 struct ParseLoop
@@ -46,24 +50,41 @@ struct ParseLoop
     ParseScope scope;
 };
 
-enum struct ParseOperator
+struct ParseExpressionNode
 {
-    Literal,
-    Plus
+    enum struct Type : uint32_t
+    {
+        Literal,
+        Variable,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate
+    };
+
+    Type type;
+
+    union
+    {
+        int32_t literal;
+        uint32_t name_symbol;
+    };
 };
 
+// An expression is a range of Ast::expression_nodes in postfix order, so operators come after
+// their operands. Subexpressions of only literals are folded while parsing, which makes a
+// constant expression a single Literal node.
 struct ParseExpression
 {
-    ParseOperator op;
-    Value operand1;
-    Value operand2;
+    uint32_t first;
+    uint32_t num;
 };
 
 struct ParseVariableDeclaration
 {
     DataType type;
-    char* name;
-    unsigned name_len;
+    uint32_t name_symbol;
     bool is_mutable;
     bool has_initial_value;
     ParseExpression value_expr;
@@ -71,35 +92,62 @@ struct ParseVariableDeclaration
 
 struct ParseVariableAssignment
 {
-    char* name;
-    unsigned name_len;
+    uint32_t name_symbol;
     ParseExpression value_expr;
 };
 
+struct ParseReturn
+{
+    ParseExpression value;
+};
 
 struct ParseNode
 {
-    enum struct Type
+    enum struct Type : uint32_t
     {
         Scope,
         FunctionDefinition,
         FunctionCall,
         Loop,
         VariableDeclaration,
-        VariableAssignment
+        VariableAssignment,
+        Return
     };
 
     Type type;
+    uint32_t index;
+};
 
-    union
-    {
-        ParseScope scope;
-        ParseFunctionDefinition function_definition;
-        ParseFunctionCall function_call;
-        ParseLoop loop;
-        ParseVariableDeclaration variable_declaration;
-        ParseVariableAssignment variable_assignment;
-    };
+struct Ast
+{
+    DynamicArray<ParseNode> nodes;
+    DynamicArray<ParseScope> scopes;
+    DynamicArray<ParseFunctionDefinition> function_definitions;
+    DynamicArray<ParseFunctionCall> function_calls;
+    DynamicArray<ParseLoop> loops;
+    DynamicArray<ParseVariableDeclaration> variable_declarations;
+    DynamicArray<ParseVariableAssignment> variable_assignments;
+    DynamicArray<ParseReturn> returns;
+    DynamicArray<Value> values;
+    DynamicArray<ParseExpressionNode> expression_nodes;
+    ParseScope root;
 };
 
-ParseScope parse(Allocator* alloc, const Token* lex_tokens, size_t num_lex_tokens);
+Ast parse(Allocator* alloc, const TokenizerResult& tokens);
+
+// Parses tokens as they are produced by a tokenizer running on another thread.
+Ast parse_from_ring(Allocator* alloc, TokenRing* ring);
+
+// Frees the tables of an AST that was built in an allocator that frees.
+void ast_destroy(Ast* ast);
+
+struct StreamingParser;
+
+// Parses a ring of tokens a piece at a time, where each piece ends with a complete definition in
+// the root scope. Each piece is its own AST with its own indices, so it can be compiled and thrown
+// away before the next one is parsed.
+StreamingParser* streaming_parser_create(Allocator* alloc, TokenRing* ring);
+void streaming_parser_destroy(Allocator* alloc, StreamingParser* sp);
+
+// Parses the next piece into ast, building it in alloc. Returns false once the tokens have ended.
+bool streaming_parser_next(StreamingParser* sp, Allocator* alloc, Ast* ast);
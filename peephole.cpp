@@ -0,0 +1,322 @@
+#include "peephole.h"
+#include "asm_instruction.h"
+#include "memory.h"
+
+// Windowed rules look at the last instructions of the output, the window, and rewrite them in
+// place. Instructions are added to the output one at a time and after each one the rules are tried
+// until none hits, so a rewrite can expose a match for another rule right away, and one pass over
+// the input is enough. Labels never match, so no rule works across functions.
+typedef bool(*PeepholeApply)(DynamicArray<AsmInstruction>* out);
+
+struct PeepholeRuleInfo
+{
+    const char* name;
+    unsigned window; // 0 for rules that look at whole functions.
+    PeepholeApply apply;
+};
+
+static bool is_register(const AsmOperand& o, AsmRegister reg)
+{
+    return o.type == AsmOperand::Type::Register && o.reg == reg;
+}
+
+// push X, pop X
+static bool apply_push_pop_same(DynamicArray<AsmInstruction>* out)
+{
+    const AsmInstruction& a = (*out)[out->num - 2];
+    const AsmInstruction& b = (*out)[out->num - 1];
+
+    if (a.op != AsmInstruction::Op::Push || b.op != AsmInstruction::Op::Pop)
+        return false;
+
+    if (b.dst.type != AsmOperand::Type::Register || !asm_operand_equal(a.dst, b.dst))
+        return false;
+
+    out->num -= 2;
+    return true;
+}
+
+// push X, pop R -> mov R, X
+static bool apply_push_pop_to_mov(DynamicArray<AsmInstruction>* out)
+{
+    AsmInstruction& a = (*out)[out->num - 2];
+    const AsmInstruction& b = (*out)[out->num - 1];
+
+    if (a.op != AsmInstruction::Op::Push || b.op != AsmInstruction::Op::Pop || b.dst.type != AsmOperand::Type::Register)
+        return false;
+
+    const AsmOperand x = a.dst;
+    a.op = AsmInstruction::Op::Mov;
+    a.dst = b.dst;
+    a.src = x;
+    --out->num;
+    return true;
+}
+
+// push X, mov R, Y, pop S -> mov R, Y, mov S, X
+// X is now read after R is written, so it can't involve R. Nothing can be relative to esp, since
+// esp is no longer moved in between.
+static bool apply_push_mov_pop(DynamicArray<AsmInstruction>* out)
+{
+    AsmInstruction& a = (*out)[out->num - 3];
+    AsmInstruction& b = (*out)[out->num - 2];
+    const AsmInstruction& c = (*out)[out->num - 1];
+
+    if (a.op != AsmInstruction::Op::Push || b.op != AsmInstruction::Op::Mov || c.op != AsmInstruction::Op::Pop)
+        return false;
+
+    if (b.dst.type != AsmOperand::Type::Register || c.dst.type != AsmOperand::Type::Register || b.dst.reg == c.dst.reg)
+        return false;
+
+    if (asm_operand_uses_register(a.dst, b.dst.reg) || asm_operand_uses_register(a.dst, AsmRegister::Esp)
+        || asm_operand_uses_register(b.src, AsmRegister::Esp) || b.dst.reg == AsmRegister::Esp)
+    {
+        return false;
+    }
+
+    const AsmOperand x = a.dst;
+    const AsmOperand s = c.dst;
+    a = b;
+    b.op = AsmInstruction::Op::Mov;
+    b.dst = s;
+    b.src = x;
+    --out->num;
+    return true;
+}
+
+// mov R, R
+static bool apply_self_mov(DynamicArray<AsmInstruction>* out)
+{
+    const AsmInstruction& a = (*out)[out->num - 1];
+
+    if (a.op != AsmInstruction::Op::Mov || a.dst.type != AsmOperand::Type::Register || !asm_operand_equal(a.dst, a.src))
+        return false;
+
+    --out->num;
+    return true;
+}
+
+// True if reading o can read what writing dst wrote. Memory operands are dword slots, so two with
+// the same base don't overlap if they are at least 4 apart. Different bases can alias.
+static bool may_read(const AsmOperand& o, const AsmOperand& dst)
+{
+    if (dst.type == AsmOperand::Type::Register)
+        return asm_operand_uses_register(o, dst.reg);
+
+    if (o.type != AsmOperand::Type::Memory)
+        return false;
+
+    if (o.reg != dst.reg)
+        return true;
+
+    const int64_t distance = (int64_t)o.value - (int64_t)dst.value;
+    return distance > -4 && distance < 4;
+}
+
+// mov D, A, mov D, B -> mov D, B
+static bool apply_overwritten_mov(DynamicArray<AsmInstruction>* out)
+{
+    AsmInstruction& a = (*out)[out->num - 2];
+    const AsmInstruction& b = (*out)[out->num - 1];
+
+    if (a.op != AsmInstruction::Op::Mov || b.op != AsmInstruction::Op::Mov || !asm_operand_equal(a.dst, b.dst) || may_read(b.src, b.dst))
+        return false;
+
+    a = b;
+    --out->num;
+    return true;
+}
+
+// mov M, R, push M -> mov M, R, push R
+// mov M, R, mov S, M -> mov M, R, mov S, R
+static bool apply_load_after_store(DynamicArray<AsmInstruction>* out)
+{
+    const AsmInstruction& a = (*out)[out->num - 2];
+    AsmInstruction& b = (*out)[out->num - 1];
+
+    if (a.op != AsmInstruction::Op::Mov || a.dst.type != AsmOperand::Type::Memory || a.src.type != AsmOperand::Type::Register)
+        return false;
+
+    if (b.op == AsmInstruction::Op::Push && asm_operand_equal(b.dst, a.dst))
+    {
+        b.dst = a.src;
+        return true;
+    }
+
+    if (b.op == AsmInstruction::Op::Mov && b.dst.type == AsmOperand::Type::Register && asm_operand_equal(b.src, a.dst))
+    {
+        b.src = a.src;
+        return true;
+    }
+
+    return false;
+}
+
+static const PeepholeRuleInfo rule_infos[] = {
+    {"push-pop-same", 2, apply_push_pop_same},
+    {"push-pop-to-mov", 2, apply_push_pop_to_mov},
+    {"push-mov-pop", 3, apply_push_mov_pop},
+    {"self-mov", 1, apply_self_mov},
+    {"overwritten-mov", 2, apply_overwritten_mov},
+    {"load-after-store", 2, apply_load_after_store},
+    {"unused-frame", 0, nullptr}
+};
+
+static_assert(sizeof(rule_infos) / sizeof(rule_infos[0]) == (size_t)PeepholeRule::Num, "Missing peephole rule info.");
+
+static bool touches_frame(const AsmInstruction& in)
+{
+    if (asm_operand_uses_register(in.dst, AsmRegister::Ebp) || asm_operand_uses_register(in.src, AsmRegister::Ebp))
+        return true;
+
+    // Pushes and pops are balanced within the body, anything else that moves esp needs the frame to
+    // restore it.
+    return is_register(in.dst, AsmRegister::Esp) && in.op != AsmInstruction::Op::Push && in.op != AsmInstruction::Op::Pop;
+}
+
+// Removes push ebp, mov ebp, esp and mov esp, ebp, pop ebp from functions whose bodies use neither
+// ebp nor esp directly, which is the case for functions without locals.
+static void remove_unused_frames(DynamicArray<AsmInstruction>* instructions, PeepholeStats* stats)
+{
+    DynamicArray<AsmInstruction>& ins = *instructions;
+    Allocator ta = create_temp_allocator();
+    bool* removed = (bool*)ta.alloc_zero(ins.num + 1);
+    bool any_removed = false;
+
+    for (unsigned i = 0; i + 5 < ins.num; ++i)
+    {
+        if (ins[i].op != AsmInstruction::Op::Label)
+            continue;
+
+        if (ins[i + 1].op != AsmInstruction::Op::Push || !is_register(ins[i + 1].dst, AsmRegister::Ebp)
+            || ins[i + 2].op != AsmInstruction::Op::Mov || !is_register(ins[i + 2].dst, AsmRegister::Ebp) || !is_register(ins[i + 2].src, AsmRegister::Esp))
+        {
+            continue;
+        }
+
+        unsigned ret = i + 3;
+
+        while (ret < ins.num && ins[ret].op != AsmInstruction::Op::Ret && ins[ret].op != AsmInstruction::Op::Label)
+            ++ret;
+
+        if (ret == ins.num || ins[ret].op != AsmInstruction::Op::Ret || ret < i + 5)
+            continue;
+
+        const AsmInstruction& restore = ins[ret - 2];
+        const AsmInstruction& pop = ins[ret - 1];
+
+        if (restore.op != AsmInstruction::Op::Mov || !is_register(restore.dst, AsmRegister::Esp) || !is_register(restore.src, AsmRegister::Ebp)
+            || pop.op != AsmInstruction::Op::Pop || !is_register(pop.dst, AsmRegister::Ebp))
+        {
+            continue;
+        }
+
+        bool uses_frame = false;
+
+        for (unsigned j = i + 3; j < ret - 2 && !uses_frame; ++j)
+            uses_frame = touches_frame(ins[j]);
+
+        if (uses_frame)
+            continue;
+
+        removed[i + 1] = removed[i + 2] = removed[ret - 2] = removed[ret - 1] = true;
+        any_removed = true;
+        ++stats->hits[(unsigned)PeepholeRule::UnusedFrame];
+    }
+
+    if (!any_removed)
+        return;
+
+    unsigned num = 0;
+
+    for (unsigned i = 0; i < ins.num; ++i)
+    {
+        if (!removed[i])
+            ins[num++] = ins[i];
+    }
+
+    ins.num = num;
+}
+
+void peephole_optimize(DynamicArray<AsmInstruction>* instructions, const PeepholeOptions& options, PeepholeStats* stats)
+{
+    // The output never gets ahead of the input, so it's built in the same array.
+    DynamicArray<AsmInstruction>& ins = *instructions;
+    DynamicArray<AsmInstruction> out = ins;
+    out.num = 0;
+
+    for (unsigned i = 0; i < ins.num; ++i)
+    {
+        out.data[out.num++] = ins[i];
+        bool hit = true;
+
+        while (hit)
+        {
+            hit = false;
+
+            for (unsigned r = 0; r < (unsigned)PeepholeRule::Num && !hit; ++r)
+            {
+                const PeepholeRuleInfo& info = rule_infos[r];
+
+                if (!options.rules[r] || info.window == 0 || out.num < info.window)
+                    continue;
+
+                hit = info.apply(&out);
+
+                if (hit)
+                    ++stats->hits[r];
+            }
+        }
+    }
+
+    ins.num = out.num;
+
+    if (options.rules[(unsigned)PeepholeRule::UnusedFrame])
+        remove_unused_frames(instructions, stats);
+}
+
+PeepholeOptions peephole_options_all()
+{
+    PeepholeOptions o = {};
+
+    for (unsigned r = 0; r < (unsigned)PeepholeRule::Num; ++r)
+        o.rules[r] = true;
+
+    return o;
+}
+
+bool peephole_options_any(const PeepholeOptions& options)
+{
+    for (unsigned r = 0; r < (unsigned)PeepholeRule::Num; ++r)
+    {
+        if (options.rules[r])
+            return true;
+    }
+
+    return false;
+}
+
+const char* peephole_rule_name(PeepholeRule rule)
+{
+    return rule_infos[(unsigned)rule].name;
+}
+
+bool peephole_rule_from_name(const char* name, PeepholeRule* rule)
+{
+    for (unsigned r = 0; r < (unsigned)PeepholeRule::Num; ++r)
+    {
+        if (str_equal(rule_infos[r].name, name))
+        {
+            *rule = (PeepholeRule)r;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void peephole_stats_add(PeepholeStats* to, const PeepholeStats& from)
+{
+    for (unsigned r = 0; r < (unsigned)PeepholeRule::Num; ++r)
+        to->hits[r] += from.hits[r];
+}
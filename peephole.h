@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+#include "dynamic_array.h"
+
+struct AsmInstruction;
+
+enum struct PeepholeRule
+{
+    PushPopSame,
+    PushPopToMov,
+    PushMovPop,
+    SelfMov,
+    OverwrittenMov,
+    LoadAfterStore,
+    UnusedFrame,
+    Num
+};
+
+struct PeepholeOptions
+{
+    bool rules[(unsigned)PeepholeRule::Num];
+};
+
+struct PeepholeStats
+{
+    uint64_t hits[(unsigned)PeepholeRule::Num];
+};
+
+PeepholeOptions peephole_options_all();
+bool peephole_options_any(const PeepholeOptions& options);
+const char* peephole_rule_name(PeepholeRule rule);
+
+// Finds a rule by the name peephole_rule_name gives it, returns false if there is none.
+bool peephole_rule_from_name(const char* name, PeepholeRule* rule);
+void peephole_stats_add(PeepholeStats* to, const PeepholeStats& from);
+
+// Rewrites instructions in place with the enabled rules and counts how often each one hit.
+void peephole_optimize(DynamicArray<AsmInstruction>* instructions, const PeepholeOptions& options, PeepholeStats* stats);
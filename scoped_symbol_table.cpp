@@ -0,0 +1,106 @@
+#include "scoped_symbol_table.h"
+#include "memory.h"
+
+static unsigned slot_start(uint32_t symbol, unsigned capacity)
+{
+    // Symbol ids are dense, spread them over the map so neighbouring ids don't form runs.
+    return (symbol * 2654435769u) & (capacity - 1);
+}
+
+static ScopedSymbolSlot* find_slot(ScopedSymbolSlot* slots, unsigned capacity, uint32_t symbol)
+{
+    unsigned i = slot_start(symbol, capacity);
+
+    while (slots[i].symbol_plus_one != 0 && slots[i].symbol_plus_one != symbol + 1)
+        i = (i + 1) & (capacity - 1);
+
+    return slots + i;
+}
+
+static void grow_slots(ScopedSymbolTable* sst)
+{
+    ScopedSymbolSlot* old_slots = sst->slots;
+    unsigned old_capacity = sst->slots_capacity;
+    unsigned new_capacity = old_capacity == 0 ? 256 : old_capacity * 2;
+    sst->slots = (ScopedSymbolSlot*)sst->allocator->alloc_zero(sizeof(ScopedSymbolSlot) * new_capacity);
+    sst->slots_capacity = new_capacity;
+
+    for (unsigned i = 0; i < old_capacity; ++i)
+    {
+        if (old_slots[i].symbol_plus_one != 0)
+            *find_slot(sst->slots, new_capacity, old_slots[i].symbol_plus_one - 1) = old_slots[i];
+    }
+
+    sst->allocator->dealloc(old_slots);
+}
+
+void scoped_symbol_table_init(ScopedSymbolTable* sst, Allocator* allocator)
+{
+    memset(sst, 0, sizeof(ScopedSymbolTable));
+    sst->allocator = allocator;
+    sst->undo = dynamic_array_create<ScopedSymbolUndo>(allocator);
+    sst->scope_starts = dynamic_array_create<unsigned>(allocator);
+    grow_slots(sst);
+}
+
+void scoped_symbol_table_destroy(ScopedSymbolTable* sst)
+{
+    sst->allocator->dealloc(sst->slots);
+    dynamic_array_destroy(&sst->undo);
+    dynamic_array_destroy(&sst->scope_starts);
+}
+
+void scoped_symbol_table_push_scope(ScopedSymbolTable* sst)
+{
+    sst->scope_starts.add(sst->undo.num);
+}
+
+void scoped_symbol_table_pop_scope(ScopedSymbolTable* sst)
+{
+    Assert(sst->scope_starts.num > 0, "Error in scoped symbol table: Popped scope that was never pushed.");
+    const unsigned start = sst->scope_starts.last();
+    --sst->scope_starts.num;
+
+    while (sst->undo.num > start)
+    {
+        const ScopedSymbolUndo& u = sst->undo.last();
+        ScopedSymbolSlot* s = find_slot(sst->slots, sst->slots_capacity, u.symbol);
+        s->value = u.value;
+        s->depth = u.depth;
+        --sst->undo.num;
+    }
+}
+
+void scoped_symbol_table_bind(ScopedSymbolTable* sst, uint32_t symbol, uint32_t value)
+{
+    Assert(sst->scope_starts.num > 0, "Error in scoped symbol table: Bound symbol outside of any scope.");
+    ScopedSymbolSlot* s = find_slot(sst->slots, sst->slots_capacity, symbol);
+
+    if (s->symbol_plus_one == 0)
+    {
+        s->symbol_plus_one = symbol + 1;
+        ++sst->slots_used;
+    }
+
+    ScopedSymbolUndo* u = sst->undo.push();
+    u->symbol = symbol;
+    u->value = s->value;
+    u->depth = s->depth;
+    s->value = value;
+    s->depth = sst->scope_starts.num;
+
+    // Keep the load factor at or below one half. Growing moves the slots, so do it last.
+    if (sst->slots_used * 2 > sst->slots_capacity)
+        grow_slots(sst);
+}
+
+bool scoped_symbol_table_find(const ScopedSymbolTable& sst, uint32_t symbol, unsigned min_depth, uint32_t* value)
+{
+    const ScopedSymbolSlot* s = find_slot(sst.slots, sst.slots_capacity, symbol);
+
+    if (s->symbol_plus_one == 0 || s->depth == 0 || s->depth < min_depth)
+        return false;
+
+    *value = s->value;
+    return true;
+}
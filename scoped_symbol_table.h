@@ -0,0 +1,51 @@
+#pragma once
+#include <stdint.h>
+#include "dynamic_array.h"
+
+struct Allocator;
+
+struct ScopedSymbolSlot
+{
+    uint32_t symbol_plus_one; // Zero means empty.
+    uint32_t value;
+    unsigned depth; // Scope depth of the binding, zero means unbound.
+};
+
+struct ScopedSymbolUndo
+{
+    uint32_t symbol;
+    uint32_t value;
+    unsigned depth;
+};
+
+// Binds symbols from a SymbolTable to values, with nested scopes where inner bindings shadow
+// outer ones. Lookups go through an open addressing hash map holding the innermost binding of
+// each symbol. Binding logs what it replaced, so leaving a scope just replays the log back to
+// where the scope started. Symbols are never removed from the map, unbinding only resets their
+// depth, so the map needs no tombstones.
+struct ScopedSymbolTable
+{
+    Allocator* allocator;
+    ScopedSymbolSlot* slots; // Linear probing.
+    unsigned slots_capacity;
+    unsigned slots_used;
+    DynamicArray<ScopedSymbolUndo> undo;
+    DynamicArray<unsigned> scope_starts; // Index into undo where each open scope started.
+};
+
+void scoped_symbol_table_init(ScopedSymbolTable* sst, Allocator* allocator);
+void scoped_symbol_table_destroy(ScopedSymbolTable* sst);
+void scoped_symbol_table_push_scope(ScopedSymbolTable* sst);
+void scoped_symbol_table_pop_scope(ScopedSymbolTable* sst);
+
+// Binds symbol in the innermost scope, shadowing any earlier binding.
+void scoped_symbol_table_bind(ScopedSymbolTable* sst, uint32_t symbol, uint32_t value);
+
+// Finds the innermost binding of symbol, ignoring bindings made in scopes shallower than
+// min_depth. The outermost scope has depth one.
+bool scoped_symbol_table_find(const ScopedSymbolTable& sst, uint32_t symbol, unsigned min_depth, uint32_t* value);
+
+inline unsigned scoped_symbol_table_depth(const ScopedSymbolTable& sst)
+{
+    return sst.scope_starts.num;
+}
@@ -0,0 +1,85 @@
+#include "symbol_table.h"
+#include "memory.h"
+
+static uint32_t symbol_hash(const char* str, unsigned len)
+{
+    uint32_t h = 2166136261u;
+
+    for (unsigned i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)str[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static void insert_slot(uint32_t* slots, unsigned capacity, uint32_t hash, uint32_t symbol)
+{
+    unsigned i = hash & (capacity - 1);
+
+    while (slots[i] != 0)
+        i = (i + 1) & (capacity - 1);
+
+    slots[i] = symbol + 1;
+}
+
+static void grow_slots(SymbolTable* st)
+{
+    uint32_t* old_slots = st->slots;
+    unsigned new_capacity = st->slots_capacity == 0 ? 256 : st->slots_capacity * 2;
+    st->slots = (uint32_t*)st->allocator->alloc_zero(sizeof(uint32_t) * new_capacity);
+    st->slots_capacity = new_capacity;
+
+    for (unsigned i = 0; i < st->symbols.num; ++i)
+        insert_slot(st->slots, new_capacity, st->symbols[i].hash, i);
+
+    st->allocator->dealloc(old_slots);
+}
+
+void symbol_table_init(SymbolTable* st, Allocator* allocator)
+{
+    memset(st, 0, sizeof(SymbolTable));
+    st->allocator = allocator;
+    st->symbols = dynamic_array_create<SymbolEntry>(allocator);
+    grow_slots(st);
+
+    uint32_t i32 = symbol_intern(st, "i32", 3);
+    Assert(i32 == SymbolI32, "Error in symbol table: Built in symbols got unexpected ids.");
+}
+
+void symbol_table_destroy(SymbolTable* st)
+{
+    st->allocator->dealloc(st->slots);
+    dynamic_array_destroy(&st->symbols);
+}
+
+uint32_t symbol_intern(SymbolTable* st, const char* str, unsigned len)
+{
+    const uint32_t hash = symbol_hash(str, len);
+    unsigned i = hash & (st->slots_capacity - 1);
+
+    while (st->slots[i] != 0)
+    {
+        const uint32_t symbol = st->slots[i] - 1;
+        const SymbolEntry& e = st->symbols[symbol];
+
+        if (e.hash == hash && e.len == len && memcmp(e.str, str, len) == 0)
+            return symbol;
+
+        i = (i + 1) & (st->slots_capacity - 1);
+    }
+
+    const uint32_t symbol = st->symbols.num;
+    SymbolEntry* e = st->symbols.push();
+    e->str = str;
+    e->len = len;
+    e->hash = hash;
+    st->slots[i] = symbol + 1;
+
+    // Keep the load factor at or below one half.
+    if (st->symbols.num * 2 > st->slots_capacity)
+        grow_slots(st);
+
+    return symbol;
+}
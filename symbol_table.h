@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+#include "dynamic_array.h"
+
+struct Allocator;
+
+// Names the compiler looks for itself. They are interned first, so their ids are fixed.
+const uint32_t SymbolI32 = 0;
+
+struct SymbolEntry
+{
+    const char* str;
+    unsigned len;
+    uint32_t hash;
+};
+
+// Interns names into dense uint32_t ids, so that name equality is an integer compare.
+struct SymbolTable
+{
+    Allocator* allocator;
+    uint32_t* slots; // Symbol id + 1, zero means empty. Open addressing with linear probing.
+    unsigned slots_capacity;
+    DynamicArray<SymbolEntry> symbols;
+};
+
+void symbol_table_init(SymbolTable* st, Allocator* allocator);
+void symbol_table_destroy(SymbolTable* st);
+uint32_t symbol_intern(SymbolTable* st, const char* str, unsigned len);
+
+inline const char* symbol_str(const SymbolTable& st, uint32_t symbol)
+{
+    return st.symbols[symbol].str;
+}
+
+inline unsigned symbol_len(const SymbolTable& st, uint32_t symbol)
+{
+    return st.symbols[symbol].len;
+}
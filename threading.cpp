@@ -0,0 +1,36 @@
+#include "threading.h"
+#include <windows.h>
+
+static DWORD WINAPI thread_entry(LPVOID param)
+{
+    Thread* t = (Thread*)param;
+    t->func(t->arg);
+    return 0;
+}
+
+void thread_start(Thread* t, ThreadFunction func, void* arg)
+{
+    t->func = func;
+    t->arg = arg;
+    t->handle = CreateThread(nullptr, 0, thread_entry, t, 0, nullptr);
+    Assert(t->handle != nullptr, "Failed creating thread.");
+}
+
+void thread_join(Thread* t)
+{
+    WaitForSingleObject(t->handle, INFINITE);
+    CloseHandle(t->handle);
+    t->handle = nullptr;
+}
+
+void thread_yield()
+{
+    SwitchToThread();
+}
+
+unsigned thread_num_cpus()
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors;
+}
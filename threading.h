@@ -0,0 +1,16 @@
+#pragma once
+
+typedef void(*ThreadFunction)(void* arg);
+
+// The Thread must stay alive until it has been joined, the new thread reads func and arg from it.
+struct Thread
+{
+    void* handle;
+    ThreadFunction func;
+    void* arg;
+};
+
+void thread_start(Thread* t, ThreadFunction func, void* arg);
+void thread_join(Thread* t);
+void thread_yield();
+unsigned thread_num_cpus();
@@ -0,0 +1,14 @@
+#include "timer.h"
+#include <windows.h>
+
+double timer_seconds()
+{
+    static LARGE_INTEGER frequency = {};
+
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
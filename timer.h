@@ -0,0 +1,4 @@
+#pragma once
+
+// Seconds since an arbitrary fixed point, for measuring how long something takes.
+double timer_seconds();
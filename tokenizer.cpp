@@ -1,47 +1,238 @@
 #include "tokenizer.h"
+#include "tokenizer_simd.h"
+#include "symbol_table.h"
+#include "threading.h"
 #include "memory.h"
 
+static const size_t TokenRingCapacity = 16 * 1024;
+static const size_t TokenRingBatchSize = TokenSpanBlockSize;
+static const size_t MaxFirstChunkCapacity = 4 * 1024 * 1024;
+
+// Tokens are written in a single pass into a list of chunks that double in size, and copied
+// into one contiguous array once the number of tokens is known.
+struct TokenChunk
+{
+    TokenChunk* next;
+    Token::Type* types;
+    TokenSpan* spans;
+    uint32_t* symbols;
+    size_t num;
+};
+
 struct TokenizerState
 {
     char* start;
     char* head;
     char* end;
-    Token* out;
+    Token::Type* out_types;
+    TokenSpan* out_spans;
+    uint32_t* out_symbols;
+    uint64_t* out_span_bases;
+    size_t out_span_bases_mask;
+    size_t out_chunk_left;
     size_t out_num;
-    void(*add_action)(TokenizerState*, Token::Type, char*, unsigned);
+    TokenChunk* first_chunk;
+    TokenChunk* current_chunk;
+    size_t next_chunk_capacity;
+    Allocator* chunk_allocator;
+    TokenRing* ring;
+    bool batch_published;
+    SymbolTable* symbol_table;
+    const TokenizerScanners* scanners;
+
+    #if defined(DEBUG)
+        bool count_only;
+    #endif
 };
 
-static void add_token(TokenizerState* ts, Token::Type type, char* val, unsigned len)
+static void add_chunk(TokenizerState* ts)
 {
-    ts->add_action(ts, type, val, len);
+    TokenChunk* c = (TokenChunk*)ts->chunk_allocator->alloc(sizeof(TokenChunk));
+    c->next = nullptr;
+    c->types = (Token::Type*)ts->chunk_allocator->alloc(sizeof(Token::Type) * ts->next_chunk_capacity);
+    c->spans = (TokenSpan*)ts->chunk_allocator->alloc(sizeof(TokenSpan) * ts->next_chunk_capacity);
+    c->symbols = (uint32_t*)ts->chunk_allocator->alloc(sizeof(uint32_t) * ts->next_chunk_capacity);
+    c->num = ts->next_chunk_capacity;
+
+    if (ts->current_chunk == nullptr)
+        ts->first_chunk = c;
+    else
+        ts->current_chunk->next = c;
+
+    ts->current_chunk = c;
+    ts->out_types = c->types;
+    ts->out_spans = c->spans;
+    ts->out_symbols = c->symbols;
+    ts->out_chunk_left = c->num;
+    ts->next_chunk_capacity *= 2;
 }
 
-static void tokenize_name(TokenizerState* ts)
+// Hands the batch that was just filled to the consumer and waits for room for the next one.
+static void next_ring_batch(TokenizerState* ts)
 {
-    char* val = ts->head;
+    TokenRing* ring = ts->ring;
+    ring->written.store(ts->out_num, std::memory_order_release);
+    ts->batch_published = true;
 
-    while (*ts->head >= 'a' && *ts->head <= 'z' || *ts->head >= '0' && *ts->head <= '9')
-        ++ts->head;
+    // An inline producer only runs when the consumer has run out of tokens, so there is room.
+    Assert(!ring->inline_producer || ts->out_num + TokenRingBatchSize - ring->consumed.load(std::memory_order_acquire) <= ring->capacity,
+        "Error in tokenizer: Inline token ring producer ran out of room.");
 
-    add_token(ts, Token::Type::Name, val, (unsigned)mem_ptr_diff(val, ts->head));
+    while (ts->out_num + TokenRingBatchSize - ring->consumed.load(std::memory_order_acquire) > ring->capacity)
+        thread_yield();
+
+    const size_t slot = ts->out_num & (ring->capacity - 1);
+    ts->out_types = ring->types + slot;
+    ts->out_spans = ring->spans + slot;
+    ts->out_symbols = ring->symbols + slot;
+    ts->out_chunk_left = TokenRingBatchSize;
 }
 
-static void tokenize_num_literal(TokenizerState* ts)
+static void add_token(TokenizerState* ts, Token::Type type, char* val, unsigned len, uint32_t symbol = 0)
+{
+    #if defined(DEBUG)
+        if (ts->count_only)
+        {
+            ++ts->out_num;
+            return;
+        }
+    #endif
+
+    if (ts->out_chunk_left == 0)
+    {
+        if (ts->ring != nullptr)
+            next_ring_batch(ts);
+        else
+            add_chunk(ts);
+    }
+
+    const uint64_t position = mem_ptr_diff(ts->start, val);
+
+    if ((ts->out_num & (TokenSpanBlockSize - 1)) == 0 && ts->out_span_bases != nullptr)
+        ts->out_span_bases[(ts->out_num & ts->out_span_bases_mask) >> TokenSpanBlockBits] = position;
+
+    *ts->out_types = type;
+    ts->out_spans->offset = (uint32_t)position;
+    ts->out_spans->len = len;
+    *ts->out_symbols = symbol;
+    ++ts->out_types;
+    ++ts->out_spans;
+    ++ts->out_symbols;
+    --ts->out_chunk_left;
+    ++ts->out_num;
+}
+
+struct Keyword
+{
+    const char* str;
+    unsigned len;
+    Token::Type type;
+};
+
+static constexpr Keyword keywords[] = {
+    {"loop", 4, Token::Type::KwLoop},
+    {"let", 3, Token::Type::KwLet},
+    {"mut", 3, Token::Type::KwMut},
+    {"ret", 3, Token::Type::KwRet},
+    {"i8", 2, Token::Type::TypeName},
+    {"u8", 2, Token::Type::TypeName},
+    {"i16", 3, Token::Type::TypeName},
+    {"u16", 3, Token::Type::TypeName},
+    {"i32", 3, Token::Type::TypeName},
+    {"u32", 3, Token::Type::TypeName},
+    {"i64", 3, Token::Type::TypeName},
+    {"u64", 3, Token::Type::TypeName},
+    {"f32", 3, Token::Type::TypeName},
+    {"f64", 3, Token::Type::TypeName}
+};
+
+static constexpr unsigned num_keywords = sizeof(keywords) / sizeof(Keyword);
+static constexpr unsigned keyword_min_len = 2;
+static constexpr unsigned keyword_max_len = 4;
+static constexpr unsigned keyword_slots_size = 32;
+
+// Perfect for the keywords above, which the static_assert below checks. Only valid for
+// keyword_min_len <= len <= keyword_max_len.
+static constexpr unsigned keyword_hash(const char* str, unsigned len)
+{
+    return ((unsigned)str[0] + (unsigned)str[1] + (unsigned)str[len - 1] * 5 + len) & (keyword_slots_size - 1);
+}
+
+static constexpr bool keyword_collides(unsigned i, unsigned j)
+{
+    return j == num_keywords
+        ? false
+        : keyword_hash(keywords[i].str, keywords[i].len) == keyword_hash(keywords[j].str, keywords[j].len) || keyword_collides(i, j + 1);
+}
+
+static constexpr bool any_keywords_collide(unsigned i = 0)
+{
+    return i == num_keywords ? false : keyword_collides(i, i + 1) || any_keywords_collide(i + 1);
+}
+
+static_assert(!any_keywords_collide(), "Keyword hash is no longer perfect, change the multiplier in keyword_hash.");
+
+static constexpr signed char keyword_for_slot(unsigned slot, unsigned i = 0)
+{
+    return i == num_keywords
+        ? -1
+        : keyword_hash(keywords[i].str, keywords[i].len) == slot ? (signed char)i : keyword_for_slot(slot, i + 1);
+}
+
+#define keyword_slots_4(s) keyword_for_slot(s), keyword_for_slot(s + 1), keyword_for_slot(s + 2), keyword_for_slot(s + 3)
+
+// Keyword index for each hash slot, -1 for empty slots. Generated at compile time.
+static constexpr signed char keyword_slots[keyword_slots_size] = {
+    keyword_slots_4(0), keyword_slots_4(4), keyword_slots_4(8), keyword_slots_4(12),
+    keyword_slots_4(16), keyword_slots_4(20), keyword_slots_4(24), keyword_slots_4(28)
+};
+
+#undef keyword_slots_4
+
+static Token::Type classify_name(const char* str, unsigned len)
+{
+    if (len < keyword_min_len || len > keyword_max_len)
+        return Token::Type::Name;
+
+    const signed char k = keyword_slots[keyword_hash(str, len)];
+
+    if (k == -1 || keywords[k].len != len || memcmp(keywords[k].str, str, len) != 0)
+        return Token::Type::Name;
+
+    return keywords[k].type;
+}
+
+static void tokenize_name(TokenizerState* ts)
 {
     char* val = ts->head;
+    ts->head = ts->scanners->scan_name(ts->head, ts->end);
+    const unsigned len = (unsigned)mem_ptr_diff(val, ts->head);
+    const Token::Type type = classify_name(val, len);
 
-    while (*ts->head >= '0' && *ts->head <= '9')
-        ++ts->head;
+    if (type == Token::Type::Name || type == Token::Type::TypeName)
+        add_token(ts, type, val, len, symbol_intern(ts->symbol_table, val, len));
+    else
+        add_token(ts, type, val, len);
+}
 
+static void tokenize_num_literal(TokenizerState* ts)
+{
+    char* val = ts->head;
+    ts->head = ts->scanners->scan_digits(ts->head, ts->end);
     add_token(ts, Token::Type::Literal, val, (unsigned)mem_ptr_diff(val, ts->head));
 }
 
 static void run_tokenization(TokenizerState* ts)
 {
-    Assert(ts->add_action != nullptr, "Error in tokoenizer: add_action in TokenizerState not set.");
-
-    while (ts->head <= ts->end)
+    while (ts->head < ts->end)
     {
+        // Inline producers hand control back to the consumer after every published batch.
+        if (ts->batch_published && ts->ring->inline_producer)
+        {
+            ts->batch_published = false;
+            return;
+        }
+
         const char c = *ts->head;
         char* c_ptr = ts->head;
 
@@ -68,9 +259,23 @@ static void run_tokenization(TokenizerState* ts)
                 ++ts->head;
                 break;
             case '+':
+            case '*':
+            case '/':
                 add_token(ts, Token::Type::Operator, ts->head, 1);
                 ++ts->head;
                 break;
+            case '-':
+                if (ts->head + 1 < ts->end && *(ts->head + 1) == '>')
+                {
+                    add_token(ts, Token::Type::Arrow, ts->head, 2);
+                    ts->head += 2;
+                }
+                else
+                {
+                    add_token(ts, Token::Type::Operator, ts->head, 1);
+                    ++ts->head;
+                }
+                break;
             case '\n':
                 add_token(ts, Token::Type::StatementEnd, ts->head, 1);
                 ++ts->head;
@@ -80,13 +285,11 @@ static void run_tokenization(TokenizerState* ts)
                 ++ts->head;
                 break;
             case '#':
-                while (*ts->head != '\n' && !(*ts->head == '\r' && ts->head < ts->end && *(ts->head + 1) == '\n'))
-                    ++ts->head;
+                ts->head = ts->scanners->scan_comment(ts->head, ts->end);
                 break;
             case ' ':
             case '\t':
-                while (*ts->head == ' ' || *ts->head == '\t')
-                    ++ts->head;
+                ts->head = ts->scanners->scan_blanks(ts->head, ts->end);
                 break;
             default:
             {
@@ -98,12 +301,7 @@ static void run_tokenization(TokenizerState* ts)
                 {
                     tokenize_num_literal(ts);
                 }
-                else if (ts->head < ts->end && c == '-' && *(ts->head + 1) == '>')
-                {
-                    add_token(ts, Token::Type::Arrow, ts->head, 2);
-                    ts->head += 2;
-                }
-                else if (ts->head < ts->end && c == '\r' && *(ts->head + 1) == '\n')
+                else if (ts->head + 1 < ts->end && c == '\r' && *(ts->head + 1) == '\n')
                 {
                     add_token(ts, Token::Type::StatementEnd, ts->head, 2);
                     ts->head += 2;
@@ -119,38 +317,349 @@ static void run_tokenization(TokenizerState* ts)
     }
 }
 
-static void add_action_add(TokenizerState* ts, Token::Type type, char* val, unsigned len)
+static void tokenizer_state_init(TokenizerState* ts, char* data, char* head, char* end, Allocator* chunk_allocator, SymbolTable* symbols)
 {
-    Token& t = ts->out[ts->out_num];
-    t.type = type;
-    t.val = val;
-    t.len = len;
-    ++ts->out_num;
+    memset(ts, 0, sizeof(TokenizerState));
+    ts->start = data;
+    ts->head = head;
+    ts->end = end;
+    ts->chunk_allocator = chunk_allocator;
+    ts->symbol_table = symbols;
+    ts->scanners = &tokenizer_scanners_get();
+
+    // Roughly one token per four bytes of source, so most inputs fit in the first chunk. Capped so
+    // huge inputs, which are mostly whitespace and comments, don't start out with a huge chunk.
+    ts->next_chunk_capacity = (size_t)(end - head) / 4 + 64;
+
+    if (ts->next_chunk_capacity > MaxFirstChunkCapacity)
+        ts->next_chunk_capacity = MaxFirstChunkCapacity;
 }
 
-static void add_action_count(TokenizerState* ts, Token::Type type, char* val, unsigned len)
+static void finish_chunks(TokenizerState* ts)
 {
-    ++ts->out_num;
+    // Only the last chunk can be partially filled.
+    if (ts->current_chunk != nullptr)
+        ts->current_chunk->num -= ts->out_chunk_left;
+
+    ts->out_chunk_left = 0;
 }
 
-TokenizerResult tokenize(char* data, size_t size, Allocator* allocator)
+static void free_chunks(TokenizerState* ts)
 {
-    TokenizerState ts = {};
-    ts.start = data;
-    ts.head = ts.start;
-    ts.end = data + size;
-    ts.add_action = add_action_add;
+    TokenChunk* c = ts->first_chunk;
 
-    TokenizerState counter_state = ts;
-    counter_state.add_action = add_action_count;
+    while (c != nullptr)
+    {
+        TokenChunk* next = c->next;
+        ts->chunk_allocator->dealloc(c->symbols);
+        ts->chunk_allocator->dealloc(c->spans);
+        ts->chunk_allocator->dealloc(c->types);
+        ts->chunk_allocator->dealloc(c);
+        c = next;
+    }
 
-    run_tokenization(&counter_state);
-    ts.out = (Token*)allocator->alloc_zero(sizeof(Token) * (unsigned)counter_state.out_num);
-    run_tokenization(&ts);
-    Assert(ts.out_num == counter_state.out_num, "Error in tokoenizer: Counting lex pass and actual lexing pass generated different result.");
+    ts->first_chunk = nullptr;
+    ts->current_chunk = nullptr;
+}
+
+// Copies the chunked tokens into out, starting at token index first. If symbol_remap is set the
+// symbol ids of names are translated through it.
+static void gather_chunks(const TokenizerState& ts, TokenizerResult* out, size_t first, const uint32_t* symbol_remap)
+{
+    size_t i = first;
+
+    for (TokenChunk* c = ts.first_chunk; c != nullptr; c = c->next)
+    {
+        memcpy(out->types + i, c->types, sizeof(Token::Type) * c->num);
+        memcpy(out->spans + i, c->spans, sizeof(TokenSpan) * c->num);
+
+        if (symbol_remap == nullptr)
+        {
+            memcpy(out->symbols + i, c->symbols, sizeof(uint32_t) * c->num);
+        }
+        else
+        {
+            for (size_t j = 0; j < c->num; ++j)
+            {
+                const bool has_symbol = c->types[j] == Token::Type::Name || c->types[j] == Token::Type::TypeName;
+                out->symbols[i + j] = has_symbol ? symbol_remap[c->symbols[j]] : 0;
+            }
+        }
 
+        i += c->num;
+    }
+}
+
+static size_t num_span_blocks(size_t num_tokens)
+{
+    return (num_tokens + TokenSpanBlockSize - 1) >> TokenSpanBlockBits;
+}
+
+static TokenizerResult allocate_result(Allocator* allocator, char* data, size_t num, uint64_t* span_bases)
+{
     TokenizerResult tr = {};
-    tr.data = ts.out;
-    tr.num = ts.out_num;
+    tr.types = (Token::Type*)allocator->alloc(sizeof(Token::Type) * num);
+    tr.spans = (TokenSpan*)allocator->alloc(sizeof(TokenSpan) * num);
+    tr.span_bases = span_bases;
+    tr.symbols = (uint32_t*)allocator->alloc(sizeof(uint32_t) * num);
+    tr.source = data;
+    tr.num = num;
+    tr.allocator = allocator;
+    return tr;
+}
+
+static TokenizerResult tokenize_serial(char* data, size_t size, Allocator* allocator, SymbolTable* symbols)
+{
+    Allocator ta = create_temp_allocator();
+    TokenizerState ts;
+    tokenizer_state_init(&ts, data, data, data + size, &ta, symbols);
+
+    // Every token but the end of file covers at least one byte, which bounds the number of blocks.
+    ts.out_span_bases = (uint64_t*)ta.alloc(sizeof(uint64_t) * num_span_blocks(size + 1));
+    ts.out_span_bases_mask = ~(size_t)0;
+    run_tokenization(&ts);
+    add_token(&ts, Token::Type::EndOfFile, ts.end, 1);
+    finish_chunks(&ts);
+    const size_t num_blocks = num_span_blocks(ts.out_num);
+    uint64_t* span_bases = (uint64_t*)allocator->alloc(sizeof(uint64_t) * num_blocks);
+    memcpy(span_bases, ts.out_span_bases, sizeof(uint64_t) * num_blocks);
+    TokenizerResult tr = allocate_result(allocator, data, ts.out_num, span_bases);
+    gather_chunks(ts, &tr, 0, nullptr);
+
+    #if defined(DEBUG)
+        TokenizerState counter_state;
+        tokenizer_state_init(&counter_state, data, data, data + size, &ta, symbols);
+        counter_state.count_only = true;
+        run_tokenization(&counter_state);
+        Assert(ts.out_num == counter_state.out_num + 1, "Error in tokoenizer: Counting lex pass and actual lexing pass generated different result.");
+    #endif
+
+    return tr;
+}
+
+// Krang tokens never span a newline (comments end at one), so large inputs are split into ranges
+// that start right after a newline and are tokenized on one thread each. Every thread interns
+// names into its own symbol table; those are then merged in range order, which hands out the
+// same ids as a serial run. A prefix sum over the per-range token counts gives each thread
+// its slice of the output, which it fills in a second parallel step.
+static const size_t ParallelTokenizeMinSize = 1024 * 1024;
+static const size_t ParallelTokenizeMinRangeSize = 256 * 1024;
+static const unsigned MaxTokenizerThreads = 16;
+
+struct TokenizeRangeJob
+{
+    TokenizerState ts;
+    Allocator heap;
+    SymbolTable symbols;
+    uint64_t range_start;
+    uint32_t* symbol_remap;
+    bool emit_end_of_file;
+    TokenizerResult* out;
+    size_t out_first;
+    Thread thread;
+};
+
+static void tokenize_range_job(void* arg)
+{
+    TokenizeRangeJob* job = (TokenizeRangeJob*)arg;
+    run_tokenization(&job->ts);
+
+    if (job->emit_end_of_file)
+        add_token(&job->ts, Token::Type::EndOfFile, job->ts.end, 1);
+
+    finish_chunks(&job->ts);
+}
+
+// The jobs don't know the global index of their tokens while tokenizing, so the bases of the
+// span blocks that start within a job's range are filled in here. Each is found from the one
+// before it, the first one from the start of the range.
+static void fill_span_bases(TokenizerResult* out, size_t first, size_t num, uint64_t position)
+{
+    const size_t first_block_start = (first + TokenSpanBlockSize - 1) & ~(TokenSpanBlockSize - 1);
+
+    for (size_t i = first_block_start; i < first + num; i += TokenSpanBlockSize)
+    {
+        position = token_position(position, out->spans[i].offset);
+        out->span_bases[i >> TokenSpanBlockBits] = position;
+    }
+}
+
+static void gather_range_job(void* arg)
+{
+    TokenizeRangeJob* job = (TokenizeRangeJob*)arg;
+    gather_chunks(job->ts, job->out, job->out_first, job->symbol_remap);
+    fill_span_bases(job->out, job->out_first, job->ts.out_num, job->range_start);
+    free_chunks(&job->ts);
+}
+
+static unsigned num_tokenizer_threads(size_t size)
+{
+    if (size < ParallelTokenizeMinSize)
+        return 1;
+
+    size_t n = thread_num_cpus();
+
+    if (n > MaxTokenizerThreads)
+        n = MaxTokenizerThreads;
+
+    if (n > size / ParallelTokenizeMinRangeSize)
+        n = size / ParallelTokenizeMinRangeSize;
+
+    return n < 1 ? 1 : (unsigned)n;
+}
+
+static TokenizerResult tokenize_parallel(char* data, size_t size, unsigned num_threads, Allocator* allocator, SymbolTable* symbols)
+{
+    TokenizeRangeJob jobs[MaxTokenizerThreads] = {};
+    char* end = data + size;
+    char* range_start = data;
+    unsigned num_jobs = 0;
+
+    for (unsigned i = 0; i < num_threads && range_start < end; ++i)
+    {
+        char* range_end = end;
+
+        if (i < num_threads - 1)
+        {
+            char* split = data + size / num_threads * (i + 1);
+
+            if (split < range_start)
+                split = range_start;
+
+            char* newline = (char*)memchr(split, '\n', (size_t)(end - split));
+            range_end = newline == nullptr ? end : newline + 1;
+        }
+
+        TokenizeRangeJob& job = jobs[num_jobs++];
+        job.heap = create_heap_allocator();
+        symbol_table_init(&job.symbols, &job.heap);
+        tokenizer_state_init(&job.ts, data, range_start, range_end, &job.heap, &job.symbols);
+        job.range_start = mem_ptr_diff(data, range_start);
+        job.emit_end_of_file = range_end == end;
+        range_start = range_end;
+    }
+
+    for (unsigned i = 0; i < num_jobs; ++i)
+        thread_start(&jobs[i].thread, tokenize_range_job, &jobs[i]);
+
+    for (unsigned i = 0; i < num_jobs; ++i)
+        thread_join(&jobs[i].thread);
+
+    size_t num_tokens = 0;
+
+    for (unsigned i = 0; i < num_jobs; ++i)
+    {
+        TokenizeRangeJob& job = jobs[i];
+        job.out_first = num_tokens;
+        num_tokens += job.ts.out_num;
+        job.symbol_remap = (uint32_t*)job.heap.alloc(sizeof(uint32_t) * job.symbols.symbols.num);
+
+        for (unsigned s = 0; s < job.symbols.symbols.num; ++s)
+        {
+            const SymbolEntry& e = job.symbols.symbols[s];
+            job.symbol_remap[s] = symbol_intern(symbols, e.str, e.len);
+        }
+    }
+
+    uint64_t* span_bases = (uint64_t*)allocator->alloc(sizeof(uint64_t) * num_span_blocks(num_tokens));
+    TokenizerResult tr = allocate_result(allocator, data, num_tokens, span_bases);
+
+    for (unsigned i = 0; i < num_jobs; ++i)
+    {
+        jobs[i].out = &tr;
+        thread_start(&jobs[i].thread, gather_range_job, &jobs[i]);
+    }
+
+    for (unsigned i = 0; i < num_jobs; ++i)
+    {
+        thread_join(&jobs[i].thread);
+        jobs[i].heap.dealloc(jobs[i].symbol_remap);
+        symbol_table_destroy(&jobs[i].symbols);
+    }
+
+    #if defined(DEBUG)
+        Allocator ta = create_temp_allocator();
+        TokenizerResult serial = tokenize_serial(data, size, &ta, symbols);
+        Assert(serial.num == tr.num
+            && memcmp(serial.types, tr.types, sizeof(Token::Type) * tr.num) == 0
+            && memcmp(serial.spans, tr.spans, sizeof(TokenSpan) * tr.num) == 0
+            && memcmp(serial.span_bases, tr.span_bases, sizeof(uint64_t) * num_span_blocks(tr.num)) == 0
+            && memcmp(serial.symbols, tr.symbols, sizeof(uint32_t) * tr.num) == 0,
+            "Error in tokenizer: Parallel and serial tokenization generated different result.");
+    #endif
+
     return tr;
-}
\ No newline at end of file
+}
+
+TokenizerResult tokenize(char* data, size_t size, Allocator* allocator, SymbolTable* symbols)
+{
+    const unsigned num_threads = num_tokenizer_threads(size);
+
+    if (num_threads > 1)
+        return tokenize_parallel(data, size, num_threads, allocator, symbols);
+
+    return tokenize_serial(data, size, allocator, symbols);
+}
+
+static void tokenize_ring_job(void* arg)
+{
+    TokenRing* ring = (TokenRing*)arg;
+    TokenizerState* ts = ring->producer_state;
+    run_tokenization(ts);
+    add_token(ts, Token::Type::EndOfFile, ts->end, 1);
+    ring->written.store(ts->out_num, std::memory_order_release);
+    ring->finished.store(true, std::memory_order_release);
+}
+
+void token_ring_produce(TokenRing* ring)
+{
+    Assert(ring->inline_producer, "Error in tokenizer: Tried to drive a token ring that has its own thread.");
+
+    if (ring->finished.load(std::memory_order_relaxed))
+        return;
+
+    TokenizerState* ts = ring->producer_state;
+    run_tokenization(ts);
+
+    if (ts->head < ts->end)
+        return;
+
+    ts->batch_published = false;
+    add_token(ts, Token::Type::EndOfFile, ts->end, 1);
+    ring->written.store(ts->out_num, std::memory_order_release);
+    ring->finished.store(true, std::memory_order_release);
+}
+
+void token_ring_start(TokenRing* ring, char* data, size_t size, Allocator* allocator, SymbolTable* symbols, bool inline_producer)
+{
+    ring->types = (Token::Type*)allocator->alloc(sizeof(Token::Type) * TokenRingCapacity);
+    ring->spans = (TokenSpan*)allocator->alloc(sizeof(TokenSpan) * TokenRingCapacity);
+    ring->span_bases = (uint64_t*)allocator->alloc(sizeof(uint64_t) * num_span_blocks(TokenRingCapacity));
+    ring->symbols = (uint32_t*)allocator->alloc(sizeof(uint32_t) * TokenRingCapacity);
+    ring->source = data;
+    ring->capacity = TokenRingCapacity;
+    ring->written.store(0);
+    ring->consumed.store(0);
+    ring->finished.store(false);
+    ring->allocator = allocator;
+    ring->producer_state = (TokenizerState*)allocator->alloc(sizeof(TokenizerState));
+    tokenizer_state_init(ring->producer_state, data, data, data + size, nullptr, symbols);
+    ring->producer_state->ring = ring;
+    ring->producer_state->out_span_bases = ring->span_bases;
+    ring->producer_state->out_span_bases_mask = TokenRingCapacity - 1;
+    ring->inline_producer = inline_producer;
+
+    if (!inline_producer)
+        thread_start(&ring->producer, tokenize_ring_job, ring);
+}
+
+void token_ring_finish(TokenRing* ring)
+{
+    if (!ring->inline_producer)
+        thread_join(&ring->producer);
+    ring->allocator->dealloc(ring->producer_state);
+    ring->allocator->dealloc(ring->symbols);
+    ring->allocator->dealloc(ring->span_bases);
+    ring->allocator->dealloc(ring->spans);
+    ring->allocator->dealloc(ring->types);
+}
@@ -1,10 +1,15 @@
 #pragma once
+#include <stdint.h>
+#include <atomic>
+#include "threading.h"
 
 struct Allocator;
+struct SymbolTable;
+struct TokenizerState;
 
 struct Token
 {
-    enum struct Type
+    enum struct Type : unsigned char
     {
         Name,
         ArgStart,
@@ -16,19 +21,76 @@ struct Token
         EndOfFile,
         Assignment,
         Operator,
-        Arrow
+        Arrow,
+        KwLoop,
+        KwLet,
+        KwMut,
+        KwRet,
+        TypeName
     };
+};
 
-    Type type;
-    char* val;
-    unsigned len;
+// Where the token's text lives. offset is the low 32 bits of the token's position in the source.
+// The full position of the first token in each block of TokenSpanBlockSize tokens is kept in a
+// separate span_bases array, the position of any other token is found from it with
+// token_position. This works as long as no block of tokens covers 4 GiB of source or more.
+struct TokenSpan
+{
+    uint32_t offset;
+    uint32_t len;
 };
 
+const unsigned TokenSpanBlockBits = 9;
+const size_t TokenSpanBlockSize = (size_t)1 << TokenSpanBlockBits;
+
+inline uint64_t token_position(uint64_t block_base, uint32_t offset)
+{
+    return block_base + (uint32_t)(offset - (uint32_t)block_base);
+}
+
+// Tokens are stored as a structure of arrays: one byte of type plus an 8 byte span per token,
+// 9 bytes in total, where the old Token{Type, char*, unsigned} took 24. Most lookahead only
+// reads types, so 64 tokens fit in one cache line. Names and type names are interned while
+// lexing, symbols holds their ids (and is unused for other token types).
 struct TokenizerResult
 {
-    Token* data;
+    Token::Type* types;
+    TokenSpan* spans;
+    uint64_t* span_bases;
+    uint32_t* symbols;
+    char* source;
     size_t num;
     Allocator* allocator;
 };
 
-TokenizerResult tokenize(char* data, size_t size, Allocator* allocator);
+// Single producer, single consumer ring of tokens, used to run the tokenizer on its own thread
+// while the parser consumes its output. Token i lives in slot i & (capacity - 1). The producer
+// publishes whole batches through written, the consumer hands slots back through consumed.
+// Batches are span blocks, so span_bases[slot >> TokenSpanBlockBits] is the base of slot.
+struct TokenRing
+{
+    Token::Type* types;
+    TokenSpan* spans;
+    uint64_t* span_bases;
+    uint32_t* symbols;
+    char* source;
+    size_t capacity;
+    std::atomic<size_t> written;
+    std::atomic<size_t> consumed;
+    std::atomic<bool> finished;
+    Allocator* allocator;
+    TokenizerState* producer_state;
+    bool inline_producer;
+    Thread producer;
+};
+
+TokenizerResult tokenize(char* data, size_t size, Allocator* allocator, SymbolTable* symbols);
+
+// Starts tokenizing data into ring on a new thread. symbols must not be touched by anyone else
+// until token_ring_finish has returned. With inline_producer no thread is started, instead the
+// consumer calls token_ring_produce whenever it runs out of tokens, and may read symbols.
+void token_ring_start(TokenRing* ring, char* data, size_t size, Allocator* allocator, SymbolTable* symbols, bool inline_producer);
+void token_ring_finish(TokenRing* ring);
+
+// Tokenizes until one more batch has been published or the input has ended.
+void token_ring_produce(TokenRing* ring);
@@ -0,0 +1,309 @@
+#include "tokenizer_simd.h"
+#include <intrin.h>
+#include <immintrin.h>
+
+static unsigned lowest_set_bit(unsigned mask)
+{
+    unsigned long i = 0;
+    _BitScanForward(&i, mask);
+    return (unsigned)i;
+}
+
+// Scalar
+
+static bool is_name_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9');
+}
+
+static char* scalar_scan_name(char* p, char* end)
+{
+    while (p < end && is_name_char(*p))
+        ++p;
+
+    return p;
+}
+
+static char* scalar_scan_digits(char* p, char* end)
+{
+    while (p < end && *p >= '0' && *p <= '9')
+        ++p;
+
+    return p;
+}
+
+static char* scalar_scan_blanks(char* p, char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+        ++p;
+
+    return p;
+}
+
+static char* scalar_scan_comment(char* p, char* end)
+{
+    while (p < end && *p != '\n' && !(*p == '\r' && p + 1 < end && *(p + 1) == '\n'))
+        ++p;
+
+    return p;
+}
+
+// The first \n ends the comment. If it is part of a \r\n, the comment ends on the \r instead.
+static char* comment_end_at_newline(char* start, char* newline)
+{
+    return newline > start && *(newline - 1) == '\r' ? newline - 1 : newline;
+}
+
+// SSE2, 16 bytes per step
+
+static __m128i sse2_in_range(__m128i v, char lo, char hi)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+static char* sse2_scan_name(char* p, char* end)
+{
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        unsigned in_run = (unsigned)_mm_movemask_epi8(_mm_or_si128(sse2_in_range(v, 'a', 'z'), sse2_in_range(v, '0', '9')));
+
+        if (in_run != 0xFFFF)
+            return p + lowest_set_bit(~in_run);
+
+        p += 16;
+    }
+
+    return scalar_scan_name(p, end);
+}
+
+static char* sse2_scan_digits(char* p, char* end)
+{
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        unsigned in_run = (unsigned)_mm_movemask_epi8(sse2_in_range(v, '0', '9'));
+
+        if (in_run != 0xFFFF)
+            return p + lowest_set_bit(~in_run);
+
+        p += 16;
+    }
+
+    return scalar_scan_digits(p, end);
+}
+
+static char* sse2_scan_blanks(char* p, char* end)
+{
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+        unsigned in_run = (unsigned)_mm_movemask_epi8(blank);
+
+        if (in_run != 0xFFFF)
+            return p + lowest_set_bit(~in_run);
+
+        p += 16;
+    }
+
+    return scalar_scan_blanks(p, end);
+}
+
+static char* sse2_scan_comment(char* p, char* end)
+{
+    char* start = p;
+
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        unsigned newlines = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+
+        if (newlines != 0)
+            return comment_end_at_newline(start, p + lowest_set_bit(newlines));
+
+        p += 16;
+    }
+
+    // Step back one byte so a \r just before the tail is still seen by the scalar scan.
+    return scalar_scan_comment(p > start ? p - 1 : p, end);
+}
+
+// AVX2, 32 bytes per step
+
+static __m256i avx2_in_range(__m256i v, char lo, char hi)
+{
+    return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+}
+
+static char* avx2_scan_name(char* p, char* end)
+{
+    while (end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        unsigned in_run = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(avx2_in_range(v, 'a', 'z'), avx2_in_range(v, '0', '9')));
+
+        if (in_run != 0xFFFFFFFF)
+            return p + lowest_set_bit(~in_run);
+
+        p += 32;
+    }
+
+    return sse2_scan_name(p, end);
+}
+
+static char* avx2_scan_digits(char* p, char* end)
+{
+    while (end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        unsigned in_run = (unsigned)_mm256_movemask_epi8(avx2_in_range(v, '0', '9'));
+
+        if (in_run != 0xFFFFFFFF)
+            return p + lowest_set_bit(~in_run);
+
+        p += 32;
+    }
+
+    return sse2_scan_digits(p, end);
+}
+
+static char* avx2_scan_blanks(char* p, char* end)
+{
+    while (end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i blank = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+        unsigned in_run = (unsigned)_mm256_movemask_epi8(blank);
+
+        if (in_run != 0xFFFFFFFF)
+            return p + lowest_set_bit(~in_run);
+
+        p += 32;
+    }
+
+    return sse2_scan_blanks(p, end);
+}
+
+static char* avx2_scan_comment(char* p, char* end)
+{
+    char* start = p;
+
+    while (end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        unsigned newlines = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+
+        if (newlines != 0)
+            return comment_end_at_newline(start, p + lowest_set_bit(newlines));
+
+        p += 32;
+    }
+
+    return sse2_scan_comment(p > start ? p - 1 : p, end);
+}
+
+static const TokenizerScanners scalar_scanners = {"scalar", scalar_scan_name, scalar_scan_digits, scalar_scan_blanks, scalar_scan_comment};
+static const TokenizerScanners sse2_scanners = {"sse2", sse2_scan_name, sse2_scan_digits, sse2_scan_blanks, sse2_scan_comment};
+static const TokenizerScanners avx2_scanners = {"avx2", avx2_scan_name, avx2_scan_digits, avx2_scan_blanks, avx2_scan_comment};
+
+const TokenizerScanners& tokenizer_scanners_scalar()
+{
+    return scalar_scanners;
+}
+
+const TokenizerScanners& tokenizer_scanners_sse2()
+{
+    return sse2_scanners;
+}
+
+const TokenizerScanners& tokenizer_scanners_avx2()
+{
+    return avx2_scanners;
+}
+
+// In debug builds every vectorized scan is checked against the scalar one.
+#if defined(DEBUG)
+static const TokenizerScanners* checked_scanners;
+
+static char* checked_scan_name(char* p, char* end)
+{
+    char* r = checked_scanners->scan_name(p, end);
+    Assert(r == scalar_scan_name(p, end), "Error in tokenizer: Vectorized name scan disagrees with scalar scan.");
+    return r;
+}
+
+static char* checked_scan_digits(char* p, char* end)
+{
+    char* r = checked_scanners->scan_digits(p, end);
+    Assert(r == scalar_scan_digits(p, end), "Error in tokenizer: Vectorized digit scan disagrees with scalar scan.");
+    return r;
+}
+
+static char* checked_scan_blanks(char* p, char* end)
+{
+    char* r = checked_scanners->scan_blanks(p, end);
+    Assert(r == scalar_scan_blanks(p, end), "Error in tokenizer: Vectorized blank scan disagrees with scalar scan.");
+    return r;
+}
+
+static char* checked_scan_comment(char* p, char* end)
+{
+    char* r = checked_scanners->scan_comment(p, end);
+    Assert(r == scalar_scan_comment(p, end), "Error in tokenizer: Vectorized comment scan disagrees with scalar scan.");
+    return r;
+}
+
+static const TokenizerScanners checked_scanners_table = {"checked", checked_scan_name, checked_scan_digits, checked_scan_blanks, checked_scan_comment};
+#endif
+
+static bool cpu_has_sse2()
+{
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+}
+
+static bool cpu_has_avx2()
+{
+    int info[4];
+    __cpuid(info, 0);
+
+    if (info[0] < 7)
+        return false;
+
+    __cpuid(info, 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+
+    // The OS must save the upper halves of the ymm registers for us.
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+        return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+}
+
+static const TokenizerScanners* select_scanners()
+{
+    const TokenizerScanners* selected = &scalar_scanners;
+
+    if (cpu_has_avx2())
+        selected = &avx2_scanners;
+    else if (cpu_has_sse2())
+        selected = &sse2_scanners;
+
+    #if defined(DEBUG)
+        checked_scanners = selected;
+        selected = &checked_scanners_table;
+    #endif
+
+    return selected;
+}
+
+// The first call comes from the tokenizer worker threads, the static is initialized exactly once.
+const TokenizerScanners& tokenizer_scanners_get()
+{
+    static const TokenizerScanners* selected = select_scanners();
+    return *selected;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+// Run scanners used by the tokenizer. Each one returns the first position in [p, end) that is
+// not part of the run, or end if the whole range is. They never read at or beyond end.
+struct TokenizerScanners
+{
+    const char* name;
+    char*(*scan_name)(char* p, char* end); // a-z, 0-9
+    char*(*scan_digits)(char* p, char* end); // 0-9
+    char*(*scan_blanks)(char* p, char* end); // space, tab
+    char*(*scan_comment)(char* p, char* end); // stops on \n or on the \r of \r\n
+};
+
+const TokenizerScanners& tokenizer_scanners_scalar();
+const TokenizerScanners& tokenizer_scanners_sse2();
+const TokenizerScanners& tokenizer_scanners_avx2();
+
+// Picks the widest implementation the CPU supports. Resolved once, on first use.
+const TokenizerScanners& tokenizer_scanners_get();
@@ -1,13 +1,26 @@
 #include "translator.h"
 #include "memory.h"
 #include "generator.h"
+#include "symbol_table.h"
+#include "asm_instruction.h"
+#include "peephole.h"
+#include "encoder.h"
 
 struct AsmTranslationState
 {
-    char* out;
-    size_t len;
-    size_t cap;
+    AsmTranslationResult* out;
     Allocator* allocator;
+    MachineCode* machine_code;
+    AsmTarget target;
+    bool no_red_zone;
+    const SymbolTable* symbols;
+    const GeneratedCode* gc;
+    const PeepholeOptions* peephole;
+    PeepholeStats* peephole_stats;
+    DynamicArray<AsmInstruction> instructions;
+    DynamicArray<AsmInstruction> nested_instructions; // Nested functions that have ended, they go after the top level function.
+    DynamicArray<uint32_t> expression_subtree_starts;
+    DynamicArray<uint32_t> expression_spine;
 };
 
 static unsigned data_type_size(DataType type)
@@ -23,154 +36,752 @@ static unsigned data_type_size(DataType type)
     return 0;
 }
 
-static char* uint32_to_str(unsigned num)
+// Number strings are written to buffers on the caller's stack, so that translation can run on
+// several threads at once.
+static const unsigned NumberStrSize = 12;
+
+static char* uint32_to_str(char* buf, unsigned num)
 {
-    const unsigned buf_size = 4096;
-    static char buf[buf_size];
     sprintf(buf, "%u", num);
     return buf;
 }
 
+static char* int32_to_str(char* buf, int32_t num)
+{
+    sprintf(buf, "%d", num);
+    return buf;
+}
+
 static void grow(AsmTranslationState* ts, size_t min_size)
 {
-    char* old_out = ts->out;
-    size_t new_cap = ts->cap == 0 ? min_size * 2 : min_size + ts->cap * 2;
-    ts->out = (char*)ts->allocator->alloc(new_cap);
-    ts->cap = new_cap;
-    memcpy(ts->out, old_out, ts->len);
-    ts->allocator->dealloc(old_out);
+    AsmTranslationResult* out = ts->out;
+    char* old_data = out->data;
+    size_t new_capacity = out->capacity == 0 ? min_size * 2 : min_size + out->capacity * 2;
+    out->data = (char*)ts->allocator->alloc(new_capacity);
+    out->capacity = new_capacity;
+    memcpy(out->data, old_data, out->len);
+    ts->allocator->dealloc(old_data);
 }
 
 static void add_code(AsmTranslationState* ts, const char* code, size_t len)
 {
-    if (ts->len + len > ts->cap)
+    if (ts->out->len + len > ts->out->capacity)
         grow(ts, len);
 
-    memcpy(ts->out + ts->len, code, len);
-    ts->len += len;
+    memcpy(ts->out->data + ts->out->len, code, len);
+    ts->out->len += len;
 }
 
-static void translate_scope(AsmTranslationState* ts, const DynamicArray<LocalVariableData>* local_variables, const DynamicArray<AsmChunk>& chunks);
+static void add_str(AsmTranslationState* ts, const char* str)
+{
+    add_code(ts, str, strlen(str));
+}
 
-static void translate_function_definition(AsmTranslationState* ts, const DynamicArray<LocalVariableData>* local_variables, const AsmChunkFunctionDefinitionData& fd)
+static void add_symbol(AsmTranslationState* ts, uint32_t symbol)
 {
-    const static char* prologue =
-        "push ebp\n"
-        "mov ebp, esp\n";
-    const static size_t prologue_len = strlen(prologue);
+    add_code(ts, symbol_str(*ts->symbols, symbol), symbol_len(*ts->symbols, symbol));
+}
 
-    add_code(ts, fd.name, fd.name_len);
-    add_code(ts, ":\n", 2);
-    add_code(ts, prologue, prologue_len);
+static const char* asm_register_names[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"};
+static const char* asm_register_names_64[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"};
+static_assert(sizeof(asm_register_names) / sizeof(asm_register_names[0]) == (size_t)AsmRegister::R15 + 1, "Missing register name.");
+static const char* asm_op_names[] = {"", "push", "pop", "mov", "add", "sub", "imul", "neg", "cdq", "idiv", "lea", "ret"};
+static_assert(sizeof(asm_op_names) / sizeof(asm_op_names[0]) == (size_t)AsmInstruction::Op::Ret + 1, "Missing instruction name.");
 
-    unsigned local_variables_size = 0;
-    const DynamicArray<LocalVariableData>& variables = fd.local_variables;
-    for (unsigned i = 0; i < variables.num; ++i)
+// full_width is for the operands of push and pop, which are as wide as the stack slots.
+static void render_operand(AsmTranslationState* ts, const AsmOperand& o, bool size_prefix, bool full_width)
+{
+    char num_buf[NumberStrSize];
+    const bool is_64_bit = ts->target == AsmTarget::X86_64;
+
+    switch (o.type)
     {
-        local_variables_size += data_type_size(variables[i].type);
+        case AsmOperand::Type::Register:
+            if (is_64_bit && (full_width || o.reg == AsmRegister::Esp || o.reg == AsmRegister::Ebp))
+                add_str(ts, asm_register_names_64[(unsigned)o.reg]);
+            else
+                add_str(ts, asm_register_names[(unsigned)o.reg]);
+            break;
+        case AsmOperand::Type::Immediate:
+            add_str(ts, int32_to_str(num_buf, o.value));
+            break;
+        case AsmOperand::Type::Memory:
+            if (size_prefix)
+                add_str(ts, is_64_bit && full_width ? "qword " : "dword ");
+
+            add_code(ts, "[", 1);
+            add_str(ts, (is_64_bit ? asm_register_names_64 : asm_register_names)[(unsigned)o.reg]);
+
+            if (o.value < 0)
+            {
+                add_code(ts, "-", 1);
+                add_str(ts, uint32_to_str(num_buf, 0u - (uint32_t)o.value));
+            }
+            else if (o.value > 0)
+            {
+                add_code(ts, "+", 1);
+                add_str(ts, uint32_to_str(num_buf, (uint32_t)o.value));
+            }
+
+            add_code(ts, "]", 1);
+            break;
+        default:
+            Error("Error on translator: Rendering empty operand.");
+            break;
     }
+}
 
-    if (local_variables_size > 0)
+// Printing the instructions is the last step, everything before works on AsmInstructions.
+static void render_instructions(AsmTranslationState* ts)
+{
+    for (unsigned i = 0; i < ts->instructions.num; ++i)
     {
-        static const char* reserve_space_for_var = "add esp, ";
-        static const size_t reserve_space_for_var_len = strlen(reserve_space_for_var);
-        char* size_str = uint32_to_str(local_variables_size);
-        size_t size_str_len = strlen(size_str);
-        add_code(ts, reserve_space_for_var, reserve_space_for_var_len);
-        add_code(ts, size_str, size_str_len);
+        const AsmInstruction& in = ts->instructions[i];
+
+        if (in.op == AsmInstruction::Op::Label)
+        {
+            add_symbol(ts, in.symbol);
+            add_code(ts, ":\n", 2);
+            continue;
+        }
+
+        add_str(ts, asm_op_names[(unsigned)in.op]);
+
+        // lea only computes the address, it doesn't access a dword.
+        const bool size_prefix = in.op != AsmInstruction::Op::Lea;
+        const bool full_width = in.op == AsmInstruction::Op::Push || in.op == AsmInstruction::Op::Pop;
+
+        if (in.dst.type != AsmOperand::Type::None)
+        {
+            add_code(ts, " ", 1);
+            render_operand(ts, in.dst, size_prefix, full_width);
+        }
+
+        if (in.src.type != AsmOperand::Type::None)
+        {
+            add_code(ts, ", ", 2);
+            render_operand(ts, in.src, size_prefix, full_width);
+        }
+
         add_code(ts, "\n", 1);
     }
+}
+
+static AsmInstruction* emit(AsmTranslationState* ts, AsmInstruction::Op op)
+{
+    AsmInstruction* in = ts->instructions.push_init();
+    in->op = op;
+    return in;
+}
+
+static void emit(AsmTranslationState* ts, AsmInstruction::Op op, AsmOperand dst)
+{
+    emit(ts, op)->dst = dst;
+}
+
+static void emit(AsmTranslationState* ts, AsmInstruction::Op op, AsmOperand dst, AsmOperand src)
+{
+    AsmInstruction* in = emit(ts, op);
+    in->dst = dst;
+    in->src = src;
+}
+
+// The local variables of the function that is being translated. Functions can be nested in the
+// chunk stream, so these are kept on a stack that a FunctionDefinition chunk pushes to and the
+// ScopeEnd chunk that ends the function pops.
+struct TranslationFunction
+{
+    const LocalVariableData* local_variables;
+    unsigned num_local_variables;
+    bool saved_registers[(unsigned)LocalVariableRegister::Num];
+    unsigned num_saved_registers;
+    unsigned stack_slot_size;
+    unsigned local_variables_size;
+    unsigned first_instruction; // The label.
+    unsigned frame_instruction; // The sub that makes room for the stack variables, if any.
+    bool returned; // The epilogue was emitted by a Return, the ScopeEnd chunk doesn't emit another.
+};
+
+static const AsmRegister local_variable_registers[] = {
+    AsmRegister::Ebx, AsmRegister::Esi, AsmRegister::Edi, AsmRegister::R8, AsmRegister::R9, AsmRegister::R10,
+    AsmRegister::R11, AsmRegister::R12, AsmRegister::R13, AsmRegister::R14, AsmRegister::R15
+};
+
+static_assert(sizeof(local_variable_registers) / sizeof(local_variable_registers[0]) == (size_t)LocalVariableRegister::Num, "Missing local variable register.");
+
+// The System V ABI lets functions use esi, edi and r8 to r11 without saving them.
+static bool is_callee_saved(AsmTarget target, LocalVariableRegister reg)
+{
+    if (target == AsmTarget::X86)
+        return true;
+
+    switch (reg)
+    {
+        case LocalVariableRegister::Ebx:
+        case LocalVariableRegister::R12:
+        case LocalVariableRegister::R13:
+        case LocalVariableRegister::R14:
+        case LocalVariableRegister::R15:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Functions make no calls, so on X86_64 they are all leaf functions and can keep their stack
+// variables in the 128 bytes below rsp that the ABI leaves alone, as long as they don't push.
+static const unsigned RedZoneSize = 128;
+
+static unsigned align_up(unsigned v, unsigned align)
+{
+    return (v + align - 1) / align * align;
+}
+
+static void translate_function_definition(AsmTranslationState* ts, DynamicArray<TranslationFunction>* stack, const AsmChunkFunctionDefinitionData& fd)
+{
+    TranslationFunction* fn = stack->push();
+    fn->first_instruction = ts->instructions.num;
+    emit(ts, AsmInstruction::Op::Label)->symbol = fd.name_symbol;
+    emit(ts, AsmInstruction::Op::Push, asm_reg(AsmRegister::Ebp));
+    emit(ts, AsmInstruction::Op::Mov, asm_reg(AsmRegister::Ebp), asm_reg(AsmRegister::Esp));
+
+    fn->local_variables = ts->gc->local_variables.data + fd.first_local_variable;
+    fn->num_local_variables = fd.num_local_variables;
+    memset(fn->saved_registers, 0, sizeof(fn->saved_registers));
+    fn->num_saved_registers = 0;
+    fn->stack_slot_size = ts->target == AsmTarget::X86_64 ? 8 : 4;
+    fn->local_variables_size = 0;
+    fn->frame_instruction = 0;
+    fn->returned = false;
+
+    for (unsigned i = 0; i < fn->num_local_variables; ++i)
+    {
+        const LocalVariableData& lvd = fn->local_variables[i];
+
+        if (lvd.storage_type == LocalVariableStorageType::Register)
+            fn->saved_registers[(unsigned)lvd.reg] = is_callee_saved(ts->target, lvd.reg);
+        else if (lvd.storage_type == LocalVariableStorageType::Stack)
+            fn->local_variables_size += data_type_size(lvd.type);
+    }
+
+    for (unsigned r = 0; r < (unsigned)LocalVariableRegister::Num; ++r)
+    {
+        if (!fn->saved_registers[r])
+            continue;
+
+        emit(ts, AsmInstruction::Op::Push, asm_reg(local_variable_registers[r]));
+        ++fn->num_saved_registers;
+    }
+
+    if (fn->local_variables_size == 0)
+        return;
+
+    // The ABI wants rsp 16 byte aligned at calls, which it is after push rbp.
+    unsigned frame_size = fn->local_variables_size;
+
+    if (ts->target == AsmTarget::X86_64)
+    {
+        const unsigned saved_size = fn->num_saved_registers * fn->stack_slot_size;
+        frame_size = align_up(saved_size + frame_size, 16) - saved_size;
+    }
+
+    fn->frame_instruction = ts->instructions.num;
+    emit(ts, AsmInstruction::Op::Sub, asm_reg(AsmRegister::Esp), asm_imm((int32_t)frame_size));
+}
+
+// True if the function can do without the sub that makes room for its stack variables. Nested
+// functions that have ended are already moved out of its instructions.
+static bool uses_red_zone(AsmTranslationState* ts, const TranslationFunction* fn)
+{
+    if (ts->target != AsmTarget::X86_64 || ts->no_red_zone || fn->frame_instruction == 0 || fn->local_variables_size > RedZoneSize)
+        return false;
+
+    for (unsigned i = fn->frame_instruction + 1; i < ts->instructions.num; ++i)
+    {
+        if (ts->instructions[i].op == AsmInstruction::Op::Push)
+            return false;
+    }
+
+    return true;
+}
+
+static void translate_function_end(AsmTranslationState* ts, TranslationFunction* fn)
+{
+    const bool red_zone = uses_red_zone(ts, fn);
+
+    if (red_zone)
+    {
+        DynamicArray<AsmInstruction>& ins = ts->instructions;
+        memmove(ins.data + fn->frame_instruction, ins.data + fn->frame_instruction + 1, sizeof(AsmInstruction) * (ins.num - fn->frame_instruction - 1));
+        --ins.num;
+        fn->frame_instruction = 0;
+    }
+
+    // Without the sub, esp is already where the saved registers end on X86_64. X86 always resets it.
+    const bool restore_esp = ts->target == AsmTarget::X86 || fn->frame_instruction != 0;
+
+    if (fn->num_saved_registers > 0)
+    {
+        if (restore_esp)
+            emit(ts, AsmInstruction::Op::Lea, asm_reg(AsmRegister::Esp), asm_mem(AsmRegister::Ebp, -(int32_t)(fn->num_saved_registers * fn->stack_slot_size)));
+
+        for (unsigned r = (unsigned)LocalVariableRegister::Num; r-- > 0;)
+        {
+            if (fn->saved_registers[r])
+                emit(ts, AsmInstruction::Op::Pop, asm_reg(local_variable_registers[r]));
+        }
+    }
+
+    // The stack variables in the red zone use the frame, so the peephole rules never take it out
+    // and don't need to see the mov.
+    if (!red_zone)
+        emit(ts, AsmInstruction::Op::Mov, asm_reg(AsmRegister::Esp), asm_reg(AsmRegister::Ebp));
+
+    emit(ts, AsmInstruction::Op::Pop, asm_reg(AsmRegister::Ebp));
+    emit(ts, AsmInstruction::Op::Ret);
+}
+
+// Register variables are used as the register itself, stack variables as a dword at their offset
+// below the saved registers.
+static AsmOperand local_variable_operand(const TranslationFunction* fn, const LocalVariableData& lvd)
+{
+    Assert(lvd.storage_type != LocalVariableStorageType::Unused, "Error on translator: Unused local variable is used.");
+
+    if (lvd.storage_type == LocalVariableStorageType::Register)
+        return asm_reg(local_variable_registers[(unsigned)lvd.reg]);
+
+    return asm_mem(AsmRegister::Ebp, -(int32_t)(lvd.stack_offset + fn->num_saved_registers * fn->stack_slot_size));
+}
+
+static bool is_binary_expression_node(const AsmExpressionNode& n)
+{
+    switch (n.type)
+    {
+        case ParseExpressionNode::Type::Add:
+        case ParseExpressionNode::Type::Subtract:
+        case ParseExpressionNode::Type::Multiply:
+        case ParseExpressionNode::Type::Divide:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// An expression in postfix order seen as a tree. The operand of a Negate, and the right operand of
+// a binary node, is the node before it. The left operand of a binary node is the node before
+// where its right operand starts.
+struct ExpressionTree
+{
+    const AsmExpressionNode* nodes;
+    const uint32_t* subtree_starts;
+    const TranslationFunction* fn;
+};
+
+static uint32_t left_operand(const ExpressionTree& t, uint32_t n)
+{
+    return t.subtree_starts[n - 1] - 1;
+}
+
+static ExpressionTree build_expression_tree(AsmTranslationState* ts, const TranslationFunction* fn, AsmExpression expr)
+{
+    ExpressionTree t = {};
+    t.nodes = ts->gc->expression_nodes.data + expr.first;
+    t.fn = fn;
+    DynamicArray<uint32_t>& starts = ts->expression_subtree_starts;
+    starts.num = 0;
+
+    for (uint32_t i = 0; i < expr.num; ++i)
+    {
+        uint32_t start = i;
+
+        if (t.nodes[i].type == ParseExpressionNode::Type::Negate)
+            start = starts[i - 1];
+        else if (is_binary_expression_node(t.nodes[i]))
+            start = starts[starts[i - 1] - 1];
+
+        starts.add(start);
+    }
 
-    translate_scope(ts, &fd.local_variables, fd.scope_data.chunks);
+    Assert(expr.num > 0 && starts.last() == 0, "Error on translator: Malformed expression.");
+    t.subtree_starts = starts.data;
+    return t;
+}
+
+// Literals and variables are the leaves, they fit into an instruction as an operand.
+static bool is_leaf(const ExpressionTree& t, uint32_t n)
+{
+    return t.nodes[n].type == ParseExpressionNode::Type::Literal || t.nodes[n].type == ParseExpressionNode::Type::Variable;
+}
 
-    const static char* epilogue =
-        "mov esp, ebp\n"
-        "pop ebp\n";
-    const static size_t epilogue_len = strlen(epilogue);
+static AsmOperand leaf_operand(const ExpressionTree& t, uint32_t n)
+{
+    const AsmExpressionNode& node = t.nodes[n];
+
+    if (node.type == ParseExpressionNode::Type::Literal)
+        return asm_imm(node.literal);
 
-    add_code(ts, epilogue, epilogue_len);
-    add_code(ts, "ret", 3);
+    Assert(node.local_variable_index < t.fn->num_local_variables, "Error on translator: Local variable index in expression is out of bounds.");
+    return local_variable_operand(t.fn, t.fn->local_variables[node.local_variable_index]);
 }
 
-static const char* mov_init_val = "mov dword [ebp-";
-static const size_t mov_init_val_len = strlen(mov_init_val);
+static bool is_register_leaf(const ExpressionTree& t, uint32_t n)
+{
+    return is_leaf(t, n) && leaf_operand(t, n).type == AsmOperand::Type::Register;
+}
 
-static void translate_variable_declaration(AsmTranslationState* ts, const DynamicArray<LocalVariableData>* local_variables, const AsmChunkVariableDeclarationData& vd)
+// Matches register + constant, constant + register and register - constant, which lea computes
+// into any register in one instruction.
+static bool match_lea(const ExpressionTree& t, uint32_t n, AsmOperand* address)
 {
-    Assert(vd.local_variable_index < local_variables->num, "Error on translator: Local variable index in variable declaration is out of bounds.");
+    const ParseExpressionNode::Type type = t.nodes[n].type;
+
+    if (type != ParseExpressionNode::Type::Add && type != ParseExpressionNode::Type::Subtract)
+        return false;
+
+    const uint32_t lhs = left_operand(t, n);
+    const uint32_t rhs = n - 1;
+    uint32_t reg = lhs;
+    uint32_t constant = rhs;
+
+    if (type == ParseExpressionNode::Type::Add && t.nodes[lhs].type == ParseExpressionNode::Type::Literal)
+    {
+        reg = rhs;
+        constant = lhs;
+    }
+
+    if (!is_register_leaf(t, reg) || t.nodes[constant].type != ParseExpressionNode::Type::Literal)
+        return false;
+
+    int32_t displacement = t.nodes[constant].literal;
+
+    if (type == ParseExpressionNode::Type::Subtract)
+        displacement = (int32_t)(0u - (uint32_t)displacement);
+
+    *address = asm_mem(leaf_operand(t, reg).reg, displacement);
+    return true;
+}
+
+static bool writes_register(const AsmInstruction& in, AsmRegister reg)
+{
+    // The operand of push and idiv is only read.
+    if (in.op == AsmInstruction::Op::Push || in.op == AsmInstruction::Op::Idiv)
+        return false;
+
+    return in.dst.type == AsmOperand::Type::Register && in.dst.reg == reg;
+}
+
+// eax op= src. idiv can't take an immediate, so constant divisors go through ecx.
+static void select_binary_op(AsmTranslationState* ts, ParseExpressionNode::Type type, AsmOperand src)
+{
+    const AsmOperand eax = asm_reg(AsmRegister::Eax);
+
+    switch (type)
+    {
+        case ParseExpressionNode::Type::Add: emit(ts, AsmInstruction::Op::Add, eax, src); break;
+        case ParseExpressionNode::Type::Subtract: emit(ts, AsmInstruction::Op::Sub, eax, src); break;
+        case ParseExpressionNode::Type::Multiply: emit(ts, AsmInstruction::Op::Imul, eax, src); break;
+        case ParseExpressionNode::Type::Divide:
+            if (src.type == AsmOperand::Type::Immediate)
+            {
+                emit(ts, AsmInstruction::Op::Mov, asm_reg(AsmRegister::Ecx), src);
+                src = asm_reg(AsmRegister::Ecx);
+            }
+
+            emit(ts, AsmInstruction::Op::Cdq);
+            emit(ts, AsmInstruction::Op::Idiv, src);
+            break;
+        default:
+            Error("Error on translator: Unknown binary expression node type.");
+            break;
+    }
+}
+
+static void select_expression(AsmTranslationState* ts, const ExpressionTree& t, uint32_t n);
+
+// Tiles a node that isn't a leaf operation applied to the result of its left operand.
+static void select_expression_root(AsmTranslationState* ts, const ExpressionTree& t, uint32_t n)
+{
+    const AsmOperand eax = asm_reg(AsmRegister::Eax);
+    const AsmOperand ecx = asm_reg(AsmRegister::Ecx);
+    const AsmExpressionNode& node = t.nodes[n];
+    AsmOperand address;
+
+    if (is_leaf(t, n))
+    {
+        emit(ts, AsmInstruction::Op::Mov, eax, leaf_operand(t, n));
+        return;
+    }
+
+    if (match_lea(t, n, &address))
+    {
+        emit(ts, AsmInstruction::Op::Lea, eax, address);
+        return;
+    }
+
+    Assert(is_binary_expression_node(node), "Error on translator: Unknown expression node type.");
+    const uint32_t lhs = left_operand(t, n);
+    select_expression(ts, t, n - 1);
+
+    if (is_leaf(t, lhs))
+    {
+        const AsmOperand lhs_operand = leaf_operand(t, lhs);
+
+        switch (node.type)
+        {
+            case ParseExpressionNode::Type::Add:
+            case ParseExpressionNode::Type::Multiply:
+                select_binary_op(ts, node.type, lhs_operand);
+                break;
+            case ParseExpressionNode::Type::Subtract:
+                emit(ts, AsmInstruction::Op::Neg, eax);
+                emit(ts, AsmInstruction::Op::Add, eax, lhs_operand);
+                break;
+            default:
+                emit(ts, AsmInstruction::Op::Mov, ecx, eax);
+                emit(ts, AsmInstruction::Op::Mov, eax, lhs_operand);
+                select_binary_op(ts, node.type, ecx);
+                break;
+        }
+
+        return;
+    }
+
+    // The right operand waits in ecx while the left one is computed, unless computing it uses ecx,
+    // then it waits on the stack.
+    const unsigned save = ts->instructions.num;
+    emit(ts, AsmInstruction::Op::Mov, ecx, eax);
+    select_expression(ts, t, lhs);
+    bool ecx_written = false;
+
+    for (unsigned i = save + 1; i < ts->instructions.num && !ecx_written; ++i)
+        ecx_written = writes_register(ts->instructions[i], AsmRegister::Ecx);
+
+    if (ecx_written)
+    {
+        AsmInstruction& in = ts->instructions[save];
+        in.op = AsmInstruction::Op::Push;
+        in.dst = eax;
+        in.src = {};
+        emit(ts, AsmInstruction::Op::Pop, ecx);
+    }
+
+    select_binary_op(ts, node.type, ecx);
+}
+
+// Computes node n into eax. Negations and operations with a leaf as right operand are applied to
+// eax in place, as a single instruction each with the leaf as operand. They are collected down
+// the left operands first, so that long chains like a + b + c don't recurse.
+static void select_expression(AsmTranslationState* ts, const ExpressionTree& t, uint32_t n)
+{
+    DynamicArray<uint32_t>& spine = ts->expression_spine;
+    const unsigned spine_base = spine.num;
+    AsmOperand address;
+
+    while (true)
+    {
+        if (t.nodes[n].type == ParseExpressionNode::Type::Negate)
+        {
+            spine.add(n);
+            n = n - 1;
+        }
+        else if (is_binary_expression_node(t.nodes[n]) && is_leaf(t, n - 1) && !match_lea(t, n, &address))
+        {
+            spine.add(n);
+            n = left_operand(t, n);
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    select_expression_root(ts, t, n);
+
+    while (spine.num > spine_base)
+    {
+        const uint32_t s = spine.last();
+        --spine.num;
+
+        if (t.nodes[s].type == ParseExpressionNode::Type::Negate)
+            emit(ts, AsmInstruction::Op::Neg, asm_reg(AsmRegister::Eax));
+        else
+            select_binary_op(ts, t.nodes[s].type, leaf_operand(t, s - 1));
+    }
+}
+
+static void translate_store_to_local(AsmTranslationState* ts, const TranslationFunction* fn, unsigned local_variable_index, AsmExpression value)
+{
+    const AsmOperand dst = local_variable_operand(fn, fn->local_variables[local_variable_index]);
+    const AsmOperand eax = asm_reg(AsmRegister::Eax);
+    const ExpressionTree t = build_expression_tree(ts, fn, value);
+    const uint32_t root = value.num - 1;
+    AsmOperand address;
+
+    if (is_leaf(t, root))
+    {
+        const AsmOperand src = leaf_operand(t, root);
+
+        if (asm_operand_equal(src, dst))
+            return;
+
+        // There is no memory to memory mov.
+        if (src.type == AsmOperand::Type::Memory && dst.type == AsmOperand::Type::Memory)
+        {
+            emit(ts, AsmInstruction::Op::Mov, eax, src);
+            emit(ts, AsmInstruction::Op::Mov, dst, eax);
+            return;
+        }
+
+        emit(ts, AsmInstruction::Op::Mov, dst, src);
+        return;
+    }
+
+    if (dst.type == AsmOperand::Type::Register && match_lea(t, root, &address))
+    {
+        emit(ts, AsmInstruction::Op::Lea, dst, address);
+        return;
+    }
+
+    select_expression(ts, t, root);
+    emit(ts, AsmInstruction::Op::Mov, dst, eax);
+}
+
+static void translate_variable_declaration(AsmTranslationState* ts, const TranslationFunction* fn, const AsmChunkVariableDeclarationData& vd)
+{
+    Assert(vd.local_variable_index < fn->num_local_variables, "Error on translator: Local variable index in variable declaration is out of bounds.");
 
     if (!vd.has_initial_value)
         return;
 
-    const LocalVariableData& lvd = (*local_variables)[vd.local_variable_index];
-    char* stack_offset_str = uint32_to_str(lvd.stack_offset);
-    size_t stack_offset_str_len = strlen(stack_offset_str);
-    add_code(ts, mov_init_val, mov_init_val_len);
-    add_code(ts, stack_offset_str, stack_offset_str_len);
-    add_code(ts, "], ", 2);
-    add_code(ts, vd.initial_value.operand1.str_val, vd.initial_value.operand1.str_val_len);
-    add_code(ts, "\n", 1);
+    translate_store_to_local(ts, fn, vd.local_variable_index, vd.initial_value);
 }
 
-static void translate_return(AsmTranslationState* ts, const DynamicArray<LocalVariableData>* local_variables, const AsmChunkReturnData& ret)
+// A Return leaves through its own epilogue instead of falling through into whatever follows it.
+static void translate_return(AsmTranslationState* ts, TranslationFunction* fn, const AsmChunkReturnData& ret)
 {
-    add_code(ts, "mov eax, ", strlen("mov eax, "));
-    add_code(ts, ret.value.operand1.str_val, ret.value.operand1.str_val_len);
-    add_code(ts, "\n", 1);
+    const ExpressionTree t = build_expression_tree(ts, fn, ret.value);
+    select_expression(ts, t, ret.value.num - 1);
+    translate_function_end(ts, fn);
+    fn->returned = true;
 }
 
-static void translate_variable_assignment(AsmTranslationState* ts, const DynamicArray<LocalVariableData>* local_variables, const AsmChunkVariableAssignmentData& ad)
+static void translate_variable_assignment(AsmTranslationState* ts, const TranslationFunction* fn, const AsmChunkVariableAssignmentData& ad)
 {
-    Assert(ad.local_variable_index < local_variables->num, "Error on translator: Local variable index in variable assignment is out of bounds.");
-    const LocalVariableData& lvd = (*local_variables)[ad.local_variable_index];
-    char* stack_offset_str = uint32_to_str(lvd.stack_offset);
-    size_t stack_offset_str_len = strlen(stack_offset_str);
-    add_code(ts, mov_init_val, mov_init_val_len);
-    add_code(ts, stack_offset_str, stack_offset_str_len);
-    add_code(ts, "], ", 2);
-    add_code(ts, ad.value.operand1.str_val, ad.value.operand1.str_val_len);
-    add_code(ts, "\n", 1);
+    Assert(ad.local_variable_index < fn->num_local_variables, "Error on translator: Local variable index in variable assignment is out of bounds.");
+    translate_store_to_local(ts, fn, ad.local_variable_index, ad.value);
 }
 
-static void translate_scope(AsmTranslationState* ts, const DynamicArray<LocalVariableData>* local_variables, const DynamicArray<AsmChunk>& chunks)
+// Instructions are collected per top level function, which is the unit the peephole rules work
+// within, and rendered and encoded once it ends.
+static void flush_instructions(AsmTranslationState* ts)
 {
-    for (unsigned i = 0; i < chunks.num; ++i)
+    if (peephole_options_any(*ts->peephole))
+        peephole_optimize(&ts->instructions, *ts->peephole, ts->peephole_stats);
+
+    if (ts->out != nullptr)
+        render_instructions(ts);
+
+    if (ts->machine_code != nullptr)
+        encode_instructions(ts->machine_code, ts->instructions.data, ts->instructions.num, ts->target);
+
+    ts->instructions.num = 0;
+}
+
+static void translate_chunks_to_instructions(AsmTranslationState* ts)
+{
+    const GeneratedCode& gc = *ts->gc;
+    Allocator ta = create_temp_allocator();
+    DynamicArray<TranslationFunction> stack = dynamic_array_create<TranslationFunction>(&ta);
+    ts->instructions = dynamic_array_create<AsmInstruction>(&ta);
+    ts->nested_instructions = dynamic_array_create<AsmInstruction>(&ta);
+    ts->expression_subtree_starts = dynamic_array_create<uint32_t>(&ta);
+    ts->expression_spine = dynamic_array_create<uint32_t>(&ta);
+
+    for (unsigned i = 0; i < gc.chunks.num; ++i)
     {
-        const AsmChunk& a = chunks[i];
+        const AsmChunk& a = gc.chunks[i];
+        const TranslationFunction* fn = stack.num > 0 ? &stack.last() : nullptr;
+        Assert(fn != nullptr || a.type == AsmChunk::Type::FunctionDefinition, "Error on translator: Chunk outside of function.");
 
         switch (a.type)
         {
             case AsmChunk::Type::FunctionDefinition:
-                translate_function_definition(ts, local_variables, a.function_definition);
+                translate_function_definition(ts, &stack, gc.function_definitions[a.index]);
                 break;
+            case AsmChunk::Type::ScopeEnd:
+            {
+                if (!stack.last().returned)
+                    translate_function_end(ts, &stack.last());
+
+                const unsigned first = stack.last().first_instruction;
+                --stack.num;
+
+                if (stack.num > 0)
+                {
+                    // Moved out of the way so the enclosing function doesn't run into it.
+                    for (unsigned j = first; j < ts->instructions.num; ++j)
+                        ts->nested_instructions.add(ts->instructions[j]);
+
+                    ts->instructions.num = first;
+                    break;
+                }
+
+                for (unsigned j = 0; j < ts->nested_instructions.num; ++j)
+                    ts->instructions.add(ts->nested_instructions[j]);
+
+                ts->nested_instructions.num = 0;
+                flush_instructions(ts);
+            } break;
             case AsmChunk::Type::Return:
-                translate_return(ts, local_variables, a.ret);
+                translate_return(ts, &stack.last(), gc.returns[a.index]);
                 break;
             case AsmChunk::Type::VariableDeclaration:
-                translate_variable_declaration(ts, local_variables, a.variable_declaration);
+                translate_variable_declaration(ts, fn, gc.variable_declarations[a.index]);
                 break;
             case AsmChunk::Type::VariableAssignment:
-                translate_variable_assignment(ts, local_variables, a.variable_assignment);
+                translate_variable_assignment(ts, fn, gc.variable_assignments[a.index]);
                 break;
-            case AsmChunk::Type::ScopeEnd:
-                return;
             default:
                 Error("Unknown asm chunk type in asm translation.");
                 break;
         }
     }
+
+    Assert(stack.num == 0, "Error on translator: Function without ScopeEnd chunk.");
 }
 
-AsmTranslationResult translate_to_asm(Allocator* allocator, const DynamicArray<AsmChunk>& chunks)
+void translate_chunks(const TranslationOutput& out, const GeneratedCode& gc, const SymbolTable& symbols, const PeepholeOptions& peephole, PeepholeStats* peephole_stats)
 {
     AsmTranslationState ts = {};
+    ts.out = out.asm_text;
+    ts.allocator = out.asm_text_allocator;
+    ts.machine_code = out.machine_code;
+    ts.target = out.target;
+    ts.no_red_zone = out.no_red_zone;
+    ts.symbols = &symbols;
+    ts.gc = &gc;
+    ts.peephole = &peephole;
+    ts.peephole_stats = peephole_stats;
+    translate_chunks_to_instructions(&ts);
+}
+
+void translate_section_header(AsmTranslationResult* out, Allocator* allocator)
+{
+    AsmTranslationState ts = {};
+    ts.out = out;
     ts.allocator = allocator;
     static const char* section_text = "section .text\n";
     static const size_t section_text_len = strlen(section_text);
     add_code(&ts, section_text, section_text_len);
-    translate_scope(&ts, nullptr, chunks);
+}
+
+AsmTranslationResult translate_to_asm(Allocator* allocator, const GeneratedCode& gc, const SymbolTable& symbols, const PeepholeOptions& peephole, PeepholeStats* peephole_stats)
+{
     AsmTranslationResult tr = {};
-    tr.data = ts.out;
-    tr.len = ts.len;
+    translate_section_header(&tr, allocator);
+    TranslationOutput out = {};
+    out.asm_text = &tr;
+    out.asm_text_allocator = allocator;
+    translate_chunks(out, gc, symbols, peephole, peephole_stats);
     return tr;
 }
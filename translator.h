@@ -1,13 +1,37 @@
 #pragma once
 #include "dynamic_array.h"
+#include "asm_instruction.h"
 
 struct AsmTranslationResult
 {
     char* data;
     size_t len;
+    size_t capacity;
 };
 
 struct Allocator;
-struct AsmChunk;
+struct GeneratedCode;
+struct SymbolTable;
+struct PeepholeOptions;
+struct PeepholeStats;
+struct MachineCode;
 
-AsmTranslationResult translate_to_asm(Allocator* allocator, const DynamicArray<AsmChunk>& chunks);
\ No newline at end of file
+// Where translated functions go. The same instructions for target are rendered to asm_text and
+// encoded to machine_code, either can be null.
+struct TranslationOutput
+{
+    AsmTranslationResult* asm_text;
+    Allocator* asm_text_allocator;
+    MachineCode* machine_code;
+    AsmTarget target;
+    bool no_red_zone; // Keeps the stack variables of X86_64 leaf functions above rsp.
+};
+
+// Selects instructions for the chunks, runs the peephole rules of peephole over them and renders
+// them as text.
+AsmTranslationResult translate_to_asm(Allocator* allocator, const GeneratedCode& gc, const SymbolTable& symbols, const PeepholeOptions& peephole, PeepholeStats* peephole_stats);
+
+// Building blocks of translate_to_asm that append to the outputs. Used to translate functions on
+// several threads, each into its own buffers.
+void translate_section_header(AsmTranslationResult* out, Allocator* allocator);
+void translate_chunks(const TranslationOutput& out, const GeneratedCode& gc, const SymbolTable& symbols, const PeepholeOptions& peephole, PeepholeStats* peephole_stats);
\ No newline at end of file